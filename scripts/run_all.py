@@ -11,19 +11,23 @@ TESTS = {
     "bottomlessBagTest": [],
     "sandArrangementTest": [],
     "crystalSelectionTest": [],
+    "threadPoolTest": [],
     "bottomlessBagTest 1": [],
     "sandArrangementTest 1": [],
     "crystalSelectionTest 1": [],
+    "threadPoolTest 1": [],
 }
 PERFORMANCE_TESTS = [
     "bottomlessBagTest 1",
     "sandArrangementTest 1",
     "crystalSelectionTest 1",
+    "threadPoolTest 1",
 ]
 SKIP_VALGRIND = [
     "bottomlessBagTest 1",
     "sandArrangementTest 1",
     "crystalSelectionTest 1",
+    "threadPoolTest 1",
 ]
 
 PerformanceThreshold = collections.namedtuple(
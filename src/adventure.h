@@ -2,22 +2,687 @@
 #define SRC_ADVENTURE_H_
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "../third_party/threadpool/threadpool.h"
 
+#include "./simd.h"
 #include "./types.h"
 #include "./utils.h"
 
+// best crystal published by many threads without a lock. The shininess is
+// one atomic padded on either side so that its cache line holds nothing
+// else, even on the heap, where C++11 new ignores alignas; a record nothing
+// was published to reads as Crystal(0). Crystals are compared by shininess,
+// without the cost of Crystal::operator<.
+class BestCrystalRecord {
+ public:
+  // one thread's view of the record; it remembers the best shininess it has
+  // seen, so crystals that do not beat it never touch the shared line
+  class Publisher {
+   public:
+    explicit Publisher(BestCrystalRecord* recordArg)
+        : record(recordArg), seen(recordArg->best().getShininess()) {}
+
+    void offer(const Crystal& crystal) {
+      if (crystal.getShininess() > seen) {
+        seen = record->publish(crystal.getShininess());
+      }
+    }
+
+   private:
+    BestCrystalRecord* record;
+    uint64_t seen;
+  };
+
+  BestCrystalRecord() : shininess(0) {}
+
+  // raises the record to the shininess unless it is already higher, and
+  // returns the record afterwards
+  uint64_t publish(uint64_t candidate) {
+    uint64_t current = shininess.load(std::memory_order_relaxed);
+    while (current < candidate &&
+           !shininess.compare_exchange_weak(current, candidate,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+    }
+    return std::max(current, candidate);
+  }
+
+  // a snapshot: the best crystal published before the call, or a later one
+  Crystal best() const {
+    return Crystal(shininess.load(std::memory_order_acquire));
+  }
+
+ private:
+  char leadingPadding[64];
+  std::atomic<uint64_t> shininess;
+  char padding[64 - sizeof(std::atomic<uint64_t>)];
+};
+
+// the part of a council one adventure uses: the calling thread and at most
+// shamans - 1 tasks queued or running at once, however many threads call the
+// adventure and however many workers the council has. Work past the budget
+// runs on the calling thread.
+class ShamanBudget {
+ public:
+  // the council must outlive the budget
+  ShamanBudget(ThreadPool* councilArg, uint64_t shamansArg)
+      : council(councilArg), shamans(shamansArg), tasksInFlight(0) {}
+
+  uint64_t size() const { return shamans; }
+
+  // posts fn(args...) to the council as post_ref does while the budget
+  // lasts, and runs it at once otherwise; the returned handle is then
+  // already done
+  template <typename Fn, typename... Args>
+  TaskHandle fork(Fn fn, Args&&... args) {
+    if (reserve(1) == 0) {
+      fn(std::forward<Args>(args)...);
+      return TaskHandle();
+    }
+    try {
+      return council->post_ref(budgetedTask<Fn>{fn, this},
+                               std::forward<Args>(args)...);
+    } catch (...) {
+      tasksInFlight--;
+      throw;
+    }
+  }
+
+  // enqueue_ref within the budget; past it fn(args...) runs at once and the
+  // returned future is ready
+  template <typename Fn, typename... Args>
+  auto dispatch(Fn fn, Args&&... args)
+      -> std::future<typename std::result_of<Fn(Args...)>::type> {
+    typedef typename std::result_of<Fn(Args...)>::type result;
+    if (reserve(1) == 0) {
+      std::packaged_task<result()> task(
+          std::bind(fn, std::forward<Args>(args)...));
+      task();
+      return task.get_future();
+    }
+    try {
+      return council->enqueue_ref(budgetedTask<Fn>{fn, this},
+                                  std::forward<Args>(args)...);
+    } catch (...) {
+      tasksInFlight--;
+      throw;
+    }
+  }
+
+  // parallel_for on [begin, end) in multiples of grain, with as many helpers
+  // as the budget grants
+  template <typename Body>
+  void shareLoop(size_t begin, size_t end, size_t grain, const Body& body) {
+    if (begin >= end) return;
+    const size_t chunks = (end - begin + grain - 1) / grain;
+    const uint64_t helpers = reserve(chunks - 1);
+    try {
+      council->parallel_for(
+          begin, end, (chunks + helpers) / (helpers + 1) * grain, body);
+    } catch (...) {
+      tasksInFlight -= helpers;
+      throw;
+    }
+    tasksInFlight -= helpers;
+  }
+
+ private:
+  // a task that gives its place in the budget back once it ran
+  template <typename Fn>
+  struct budgetedTask {
+    Fn fn;
+    ShamanBudget* budget;
+    template <typename... Args>
+    auto operator()(Args&&... args)
+        -> decltype(fn(std::forward<Args>(args)...)) {
+      struct giveBack {
+        ShamanBudget* budget;
+        ~giveBack() { budget->tasksInFlight--; }
+      } back{budget};
+      return fn(std::forward<Args>(args)...);
+    }
+  };
+
+  // takes up to wanted tasks of the budget and returns how many it got
+  uint64_t reserve(uint64_t wanted) {
+    uint64_t used = tasksInFlight.load();
+    uint64_t granted;
+    do {
+      granted = std::min(wanted, shamans - 1 - used);
+      if (granted == 0) return 0;
+    } while (!tasksInFlight.compare_exchange_weak(used, used + granted));
+    return granted;
+  }
+
+  ThreadPool* council;
+  uint64_t shamans;
+  std::atomic<uint64_t> tasksInFlight;
+};
+
+// best of a changing collection of crystals. The tournament is an implicit
+// binary tree in breadth-first order: node i has children 2i and 2i + 1, the
+// leaves are nodes capacity to 2 capacity - 1, and every inner node holds the
+// winner of its subtree, so the best crystal is always at node 1. Crystals are
+// compared by shininess, ties going to the earlier position. With a council,
+// building and batch updates split the tree into one subtree per shaman.
+class CrystalTournament {
+ public:
+  // the budget, if any, must outlive the tournament
+  CrystalTournament(const std::vector<Crystal>& crystals,
+                    ShamanBudget* budgetArg)
+      : budget(budgetArg),
+        numberOfShamans(budgetArg == nullptr ? 1 : budgetArg->size()),
+        count(crystals.size()) {
+    size_t capacity = 1;
+    while (capacity < count) capacity *= 2;
+    nodes.assign(2 * capacity, match{0, npos});
+    for (size_t i = 0; i < count; i++) {
+      nodes[capacity + i] = match{crystals[i].getShininess(), i};
+    }
+    playAll();
+  }
+
+  // positions handed out so far, removed ones included
+  size_t size() const { return count; }
+
+  // adds a crystal and returns its position
+  size_t insert(const Crystal& crystal) {
+    if (count == capacity()) {
+      std::vector<match> leaves(nodes.begin() + capacity(), nodes.end());
+      nodes.assign(4 * capacity(), match{0, npos});
+      std::copy(leaves.begin(), leaves.end(), nodes.begin() + capacity());
+      playAll();
+    }
+    place(count, crystal);
+    return count++;
+  }
+
+  void remove(size_t position) {
+    check(position);
+    nodes[capacity() + position] = match{0, npos};
+    replayPath(capacity() + position);
+  }
+
+  // sets the crystal at a position, bringing back a removed one
+  void update(size_t position, const Crystal& crystal) {
+    check(position);
+    place(position, crystal);
+  }
+
+  // sets many crystals at once; every subtree with changes is replayed by a
+  // shaman, and every inner node at most once
+  void update(const std::vector<std::pair<size_t, Crystal>>& changes) {
+    const size_t top = subtrees();
+    std::vector<std::vector<size_t>> touched(top);
+    const size_t span = capacity() / top;
+    for (auto& change : changes) {
+      check(change.first);
+      size_t leaf = capacity() + change.first;
+      nodes[leaf] = match{change.second.getShininess(), change.first};
+      touched[leaf / span - top].push_back(leaf);
+    }
+    std::vector<size_t> busy;
+    for (size_t t = 0; t < top; t++) {
+      if (!touched[t].empty()) busy.push_back(t);
+    }
+    if (busy.empty()) return;
+    playSubtrees(busy.size(), [this, top, &busy, &touched](size_t b) {
+      replaySubtree(top + busy[b], &touched[busy[b]]);
+    });
+    for (size_t i = top - 1; i > 0; i--) replay(i);
+  }
+
+  Crystal best() const {
+    if (nodes[1].position == npos) throw std::exception();
+    return Crystal(nodes[1].shininess);
+  }
+
+  size_t bestPosition() const {
+    if (nodes[1].position == npos) throw std::exception();
+    return nodes[1].position;
+  }
+
+ private:
+  // the winner of a subtree; npos marks a subtree without crystals
+  struct match {
+    uint64_t shininess;
+    size_t position;
+  };
+
+  static const size_t npos = std::numeric_limits<size_t>::max();
+
+  static bool beats(const match& a, const match& b) {
+    if (a.position == npos) return false;
+    if (b.position == npos) return true;
+    return a.shininess > b.shininess ||
+           (a.shininess == b.shininess && a.position < b.position);
+  }
+
+  size_t capacity() const { return nodes.size() / 2; }
+
+  // subtrees played by separate shamans, a power of two
+  size_t subtrees() const {
+    size_t top = 1;
+    while (top < numberOfShamans && top < capacity()) top *= 2;
+    return top;
+  }
+
+  void check(size_t position) const {
+    if (position >= count) throw std::out_of_range("no crystal there");
+  }
+
+  void replay(size_t node) {
+    const match& left = nodes[2 * node];
+    const match& right = nodes[2 * node + 1];
+    nodes[node] = beats(right, left) ? right : left;
+  }
+
+  void replayPath(size_t node) {
+    for (node /= 2; node > 0; node /= 2) replay(node);
+  }
+
+  // help function for insert and update, sets the leaf of a position
+  void place(size_t position, const Crystal& crystal) {
+    nodes[capacity() + position] = match{crystal.getShininess(), position};
+    replayPath(capacity() + position);
+  }
+
+  // help function for playAll and update, runs play(s) for s in [0, n) on
+  // the council within the budget, the calling thread helping, or on the
+  // calling thread alone
+  template <typename Play>
+  void playSubtrees(size_t n, const Play& play) {
+    if (budget == nullptr) {
+      for (size_t s = 0; s < n; s++) play(s);
+      return;
+    }
+    budget->shareLoop(0, n, 1, [&play](size_t f, size_t r) {
+      for (size_t s = f; s < r; s++) play(s);
+    });
+  }
+
+  // help function for playAll
+  void playSubtree(size_t root) {
+    const size_t span = capacity() / subtrees();
+    // the nodes of the subtree on one level are contiguous
+    for (size_t width = span / 2; width > 0; width /= 2) {
+      for (size_t i = root * width; i < (root + 1) * width; i++) replay(i);
+    }
+  }
+
+  void playAll() {
+    const size_t top = subtrees();
+    playSubtrees(top, [this, top](size_t s) { playSubtree(top + s); });
+    for (size_t i = top - 1; i > 0; i--) replay(i);
+  }
+
+  // help function for update, replays the ancestors of changed leaves level
+  // by level up to the subtree root
+  void replaySubtree(size_t root, std::vector<size_t>* level) {
+    std::sort(level->begin(), level->end());
+    while (level->front() > root) {
+      size_t parents = 0;
+      for (size_t node : *level) {
+        if (parents == 0 || (*level)[parents - 1] != node / 2) {
+          (*level)[parents++] = node / 2;
+        }
+      }
+      level->resize(parents);
+      for (size_t node : *level) replay(node);
+    }
+  }
+
+  ShamanBudget* budget;
+  size_t numberOfShamans;
+  size_t count;
+  std::vector<match> nodes;
+};
+
 class Adventure {
  public:
+  // how selectBestCrystal compares crystals
+  enum class CrystalComparison {
+    // one Crystal::operator< per crystal, paying its comparison cost
+    kCharged,
+    // a vectorized max over the shininess keys of the crystals
+    kKeys
+  };
+
+  // statistics surveyCrystals can gather, combined with |
+  enum CrystalStatistic : unsigned {
+    kMaxCrystal = 1,
+    kMinCrystal = 2,
+    kMaxPosition = 4,
+    kMaxCount = 8,
+    kHistogram = 16
+  };
+
+  // statistics of a collection of crystals, compared by shininess; only the
+  // requested ones are set
+  struct CrystalSurvey {
+    Crystal maxCrystal;
+    Crystal minCrystal;
+    // the first position of the max crystal
+    size_t maxPosition = 0;
+    // crystals as shiny as the max crystal
+    size_t maxCount = 0;
+    // histogram[b] counts crystals with shininess in [b w, (b + 1) w) for
+    // bucket width w, the last bucket also counting all shinier ones
+    std::vector<size_t> histogram;
+  };
+
+  // running best of crystal chunks, which may be submitted from several
+  // threads; a chunk is reduced on the council as soon as it is submitted,
+  // or on the submitting thread if there is no budget or it is used up
+  class CrystalStream {
+   public:
+    // the budget, if any, must outlive the stream
+    CrystalStream(ShamanBudget* budgetArg, CrystalComparison comparisonArg)
+        : budget(budgetArg),
+          comparison(comparisonArg),
+          pending(0),
+          found(false) {}
+
+    ~CrystalStream() {
+      std::unique_lock<std::mutex> lock(mutex);
+      drained.wait(lock, [this]() { return pending == 0; });
+    }
+
+    void submit(std::vector<Crystal> chunk) {
+      if (chunk.empty()) return;
+      if (budget == nullptr) {
+        fold(bestCrystal(chunk.data(), chunk.size(), comparison));
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+      }
+      // counted before it is queued, since it may be reduced at once
+      try {
+        budget->fork(reduce, this,
+                     std::make_shared<std::vector<Crystal>>(std::move(chunk)));
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) drained.notify_all();
+        throw;
+      }
+    }
+
+    // best crystal of all chunks, once the submitted ones are reduced
+    Crystal best() {
+      std::unique_lock<std::mutex> lock(mutex);
+      drained.wait(lock, [this]() { return pending == 0; });
+      if (!found) throw std::exception();
+      return current;
+    }
+
+   private:
+    // help function for submit
+    static void reduce(CrystalStream* stream,
+                       std::shared_ptr<std::vector<Crystal>> chunk) {
+      Crystal chunkBest = bestCrystal(chunk->data(), chunk->size(),
+                                      stream->comparison);
+      std::lock_guard<std::mutex> lock(stream->mutex);
+      stream->merge(chunkBest);
+      // notified under the lock, so the stream may be destroyed as soon as
+      // a waiter sees no pending chunks
+      if (--stream->pending == 0) stream->drained.notify_all();
+    }
+
+    void fold(const Crystal& crystal) {
+      std::lock_guard<std::mutex> lock(mutex);
+      merge(crystal);
+    }
+
+    void merge(const Crystal& crystal) {
+      if (!found || current < crystal) current = crystal;
+      found = true;
+    }
+
+    ShamanBudget* budget;
+    CrystalComparison comparison;
+    std::mutex mutex;
+    std::condition_variable drained;
+    size_t pending;
+    bool found;
+    Crystal current;
+  };
+
   virtual ~Adventure() = default;
 
+  // crystals are compared one charged operator< at a time unless kKeys is
+  // chosen here
+  void setCrystalComparison(CrystalComparison crystalComparisonArg) {
+    crystalComparison = crystalComparisonArg;
+  }
+
   virtual uint64_t packEggs(std::vector<Egg>& eggs, BottomlessBag& bag) = 0;
 
   virtual void arrangeSand(std::vector<GrainOfSand>& grains) = 0;
 
+  // sorts the k smallest grains into grains[0, k), the rest follow unordered
+  virtual void arrangeSandPartially(std::vector<GrainOfSand>& grains,
+                                    size_t k) = 0;
+
+  // moves the grain of the given rank to its sorted position, with no bigger
+  // grain before it and no smaller one after it, and returns it
+  virtual GrainOfSand findGrainOfRank(std::vector<GrainOfSand>& grains,
+                                      size_t rank) = 0;
+
+  // the k smallest grains in sorted order, equal grains in input order
+  virtual std::vector<GrainOfSand> selectSmallestGrains(
+      const std::vector<GrainOfSand>& grains, size_t k) = 0;
+
+  // sorts grains by size and stores in order the input position of every
+  // sorted grain, equal grains in input order; grains themselves are only
+  // permuted when apply is set
+  virtual void arrangeSandOrder(std::vector<GrainOfSand>& grains,
+                                std::vector<uint32_t>& order, bool apply) = 0;
+  virtual void arrangeSandOrder(std::vector<GrainOfSand>& grains,
+                                std::vector<uint64_t>& order, bool apply) = 0;
+
+  // sorts every vector of batches on its own
+  virtual void arrangeSandBatch(
+      std::vector<std::vector<GrainOfSand>>& batches) = 0;
+
+  // sorts every segment [offsets[i], offsets[i + 1]) of grains on its own;
+  // throws std::invalid_argument unless offsets start at 0, never decrease
+  // and end within grains
+  virtual void arrangeSandSegments(std::vector<GrainOfSand>& grains,
+                                   const std::vector<size_t>& offsets) = 0;
+
   virtual Crystal selectBestCrystal(std::vector<Crystal>& crystals) = 0;
+
+  // position of the best crystal, the first one if several are equally good
+  virtual size_t findBestCrystal(const std::vector<Crystal>& crystals) = 0;
+
+  // positions of the k best crystals, best first and equally good crystals
+  // in input order
+  virtual std::vector<size_t> selectBestCrystals(
+      const std::vector<Crystal>& crystals, size_t k) = 0;
+
+  // the requested statistics of n > 0 crystals in one pass over them, the
+  // histogram with the given number of buckets of width bucketWidth; throws
+  // std::invalid_argument for a histogram without buckets or of width 0
+  virtual CrystalSurvey surveyCrystals(const std::vector<Crystal>& crystals,
+                                       unsigned statistics,
+                                       size_t buckets = 0,
+                                       uint64_t bucketWidth = 1) = 0;
+
+  // stream accepting chunks of crystals, reduced as they arrive
+  virtual std::unique_ptr<CrystalStream> streamCrystals() = 0;
+
+  // tournament over the crystals, kept up to date as they change; it may not
+  // outlive the adventure
+  virtual std::unique_ptr<CrystalTournament> holdCrystalTournament(
+      const std::vector<Crystal>& crystals) = 0;
+
+ protected:
+  CrystalComparison crystalComparison = CrystalComparison::kCharged;
+
+  // best of n > 0 crystals
+  static Crystal bestCrystal(const Crystal* crystals, size_t n,
+                             CrystalComparison comparison) {
+    if (comparison == CrystalComparison::kKeys) {
+      return Crystal(maxKey(Crystal::shininesses(crystals), n));
+    }
+    Crystal best = crystals[0];
+    for (size_t i = 1; i < n; i++) {
+      best = best < crystals[i] ? crystals[i] : best;
+    }
+    return best;
+  }
+
+  // true if crystal a ranks before crystal b: it is shinier, or as shiny
+  // and earlier
+  static bool ranksBefore(const Crystal* crystals, size_t a, size_t b,
+                          CrystalComparison comparison) {
+    if (comparison == CrystalComparison::kKeys) {
+      uint64_t x = crystals[a].getShininess(), y = crystals[b].getShininess();
+      return x > y || (x == y && a < b);
+    }
+    return crystals[b] < crystals[a] ||
+           (a < b && !(crystals[a] < crystals[b]));
+  }
+
+  // position of the best crystal of [f, r), f < r
+  static size_t bestCrystalPosition(const Crystal* crystals, size_t f,
+                                    size_t r, CrystalComparison comparison) {
+    size_t best = f;
+    for (size_t i = f + 1; i < r; i++) {
+      if (ranksBefore(crystals, i, best, comparison)) best = i;
+    }
+    return best;
+  }
+
+  // positions of the k best crystals of [f, r) in one pass, kept in a
+  // bounded heap with the worst of them on top
+  static std::vector<size_t> bestCrystalPositions(
+      const Crystal* crystals, size_t f, size_t r, size_t k,
+      CrystalComparison comparison) {
+    auto before = [crystals, comparison](size_t a, size_t b) {
+      return ranksBefore(crystals, a, b, comparison);
+    };
+    std::vector<size_t> heap;
+    heap.reserve(k);
+    for (size_t i = f; i < r && k > 0; i++) {
+      if (heap.size() < k) {
+        heap.push_back(i);
+        std::push_heap(heap.begin(), heap.end(), before);
+      } else if (before(i, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), before);
+        heap.back() = i;
+        std::push_heap(heap.begin(), heap.end(), before);
+      }
+    }
+    return heap;
+  }
+
+  // help function for arrangeSandSegments, rejects offsets that are no
+  // segments of grains
+  static void checkSegments(const std::vector<GrainOfSand>& grains,
+                            const std::vector<size_t>& offsets) {
+    if (offsets.empty()) return;
+    bool valid = offsets.front() == 0 && offsets.back() <= grains.size();
+    for (size_t i = 0; valid && i + 1 < offsets.size(); i++) {
+      valid = offsets[i] <= offsets[i + 1];
+    }
+    if (!valid) throw std::invalid_argument("offsets are no segments");
+  }
+
+  // help function for surveyCrystals, rejects a histogram it cannot fill
+  static void checkSurvey(unsigned statistics, size_t buckets,
+                          uint64_t bucketWidth) {
+    if ((statistics & kHistogram) && (buckets == 0 || bucketWidth == 0)) {
+      throw std::invalid_argument("histogram without buckets");
+    }
+  }
+
+  // survey of [f, r), f < r, with arguments passed by checkSurvey
+  static CrystalSurvey surveyRange(const Crystal* crystals, size_t f, size_t r,
+                                   unsigned statistics, size_t buckets,
+                                   uint64_t bucketWidth) {
+    const bool extremes = statistics & (kMaxCrystal | kMaxPosition | kMaxCount);
+    const bool histogram = statistics & kHistogram;
+    uint64_t max = crystals[f].getShininess(), min = max;
+    size_t maxPosition = f, maxCount = 0;
+    std::vector<size_t> counts(histogram ? buckets : 0);
+    for (size_t i = f; i < r; i++) {
+      const uint64_t shininess = crystals[i].getShininess();
+      if (extremes) {
+        if (shininess > max) {
+          max = shininess;
+          maxPosition = i;
+          maxCount = 1;
+        } else if (shininess == max) {
+          maxCount++;
+        }
+      }
+      if (statistics & kMinCrystal) min = std::min(min, shininess);
+      if (histogram) {
+        counts[std::min<uint64_t>(shininess / bucketWidth, buckets - 1)]++;
+      }
+    }
+    CrystalSurvey survey;
+    survey.maxCrystal = Crystal(max);
+    survey.minCrystal = Crystal(min);
+    survey.maxPosition = maxPosition;
+    survey.maxCount = maxCount;
+    survey.histogram.swap(counts);
+    return survey;
+  }
+
+  // merges the survey of a later range into a survey
+  static void mergeSurveys(CrystalSurvey* into, const CrystalSurvey& from) {
+    const uint64_t max = into->maxCrystal.getShininess();
+    if (from.maxCrystal.getShininess() > max) {
+      into->maxCrystal = from.maxCrystal;
+      into->maxPosition = from.maxPosition;
+      into->maxCount = from.maxCount;
+    } else if (from.maxCrystal.getShininess() == max) {
+      into->maxCount += from.maxCount;
+    }
+    if (from.minCrystal.getShininess() < into->minCrystal.getShininess()) {
+      into->minCrystal = from.minCrystal;
+    }
+    for (size_t b = 0; b < from.histogram.size(); b++) {
+      into->histogram[b] += from.histogram[b];
+    }
+  }
+
+  // the k best of candidate positions, best first
+  static std::vector<size_t> rankCrystals(const Crystal* crystals,
+                                          std::vector<size_t> candidates,
+                                          size_t k,
+                                          CrystalComparison comparison) {
+    auto before = [crystals, comparison](size_t a, size_t b) {
+      return ranksBefore(crystals, a, b, comparison);
+    };
+    k = std::min(k, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + k,
+                      candidates.end(), before);
+    candidates.resize(k);
+    return candidates;
+  }
 };
 
 class LonesomeAdventure : public Adventure {
@@ -58,85 +723,322 @@ class LonesomeAdventure : public Adventure {
   }
 
   virtual void arrangeSand(std::vector<GrainOfSand>& grains) {
-    std::sort(grains.begin(), grains.end());
+    std::vector<uint64_t> scratch(grains.size());
+    sortKeys(GrainOfSand::sizes(grains.data()), grains.size(), scratch.data());
+  }
+
+  virtual void arrangeSandPartially(std::vector<GrainOfSand>& grains,
+                                    size_t k) {
+    k = std::min(k, grains.size());
+    uint64_t* keys = GrainOfSand::sizes(grains.data());
+    std::nth_element(keys, keys + k, keys + grains.size());
+    std::vector<uint64_t> scratch(k);
+    sortKeys(keys, k, scratch.data());
+  }
+
+  virtual GrainOfSand findGrainOfRank(std::vector<GrainOfSand>& grains,
+                                      size_t rank) {
+    if (rank >= grains.size()) throw std::out_of_range("no grain of rank");
+    uint64_t* keys = GrainOfSand::sizes(grains.data());
+    std::nth_element(keys, keys + rank, keys + grains.size());
+    return grains[rank];
+  }
+
+  virtual std::vector<GrainOfSand> selectSmallestGrains(
+      const std::vector<GrainOfSand>& grains, size_t k) {
+    k = std::min(k, grains.size());
+    if (k == 0) return std::vector<GrainOfSand>();
+    std::vector<uint64_t> keys(grains.size());
+    for (size_t i = 0; i < grains.size(); i++) keys[i] = grains[i].getSize();
+    std::nth_element(keys.begin(), keys.begin() + k - 1, keys.end());
+    // every grain below the k-th size is taken, equal ones in input order
+    uint64_t kth = keys[k - 1];
+    size_t equal = k - std::count_if(keys.begin(), keys.begin() + k - 1,
+                                     [kth](uint64_t key) { return key < kth; });
+    std::vector<GrainOfSand> smallest;
+    for (size_t i = 0; i < grains.size() && smallest.size() < k; i++) {
+      uint64_t size = grains[i].getSize();
+      if (size < kth) {
+        smallest.push_back(grains[i]);
+      } else if (size == kth && equal > 0) {
+        smallest.push_back(grains[i]);
+        equal--;
+      }
+    }
+    std::stable_sort(smallest.begin(), smallest.end(), GrainOfSand::bySize);
+    return smallest;
+  }
+
+  template <typename Index>
+  void arrangeSandOrderOf(std::vector<GrainOfSand>& grains,
+                          std::vector<Index>& order, bool apply) {
+    const size_t n = grains.size();
+    if (n > 0 && n - 1 > std::numeric_limits<Index>::max()) {
+      throw std::length_error("too many grains for index type");
+    }
+    std::vector<std::pair<uint64_t, Index>> keys(n);
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = std::make_pair(grains[i].getSize(), static_cast<Index>(i));
+    }
+    std::sort(keys.begin(), keys.end());
+    order.resize(n);
+    for (size_t i = 0; i < n; i++) order[i] = keys[i].second;
+    if (apply) {
+      std::vector<GrainOfSand> arranged(n);
+      for (size_t i = 0; i < n; i++) arranged[i] = grains[order[i]];
+      grains.swap(arranged);
+    }
+  }
+
+  virtual void arrangeSandOrder(std::vector<GrainOfSand>& grains,
+                                std::vector<uint32_t>& order, bool apply) {
+    arrangeSandOrderOf(grains, order, apply);
+  }
+
+  virtual void arrangeSandOrder(std::vector<GrainOfSand>& grains,
+                                std::vector<uint64_t>& order, bool apply) {
+    arrangeSandOrderOf(grains, order, apply);
+  }
+
+  static void sortSegment(GrainOfSand* grains, size_t n,
+                          std::vector<uint64_t>& scratch) {
+    if (n <= 32) {
+      sortSmallKeys(GrainOfSand::sizes(grains), n);
+    } else {
+      if (scratch.size() < n) scratch.resize(n);
+      sortKeys(GrainOfSand::sizes(grains), n, scratch.data());
+    }
+  }
+
+  virtual void arrangeSandBatch(
+      std::vector<std::vector<GrainOfSand>>& batches) {
+    std::vector<uint64_t> scratch;
+    for (auto& grains : batches) {
+      sortSegment(grains.data(), grains.size(), scratch);
+    }
+  }
+
+  virtual void arrangeSandSegments(std::vector<GrainOfSand>& grains,
+                                   const std::vector<size_t>& offsets) {
+    checkSegments(grains, offsets);
+    std::vector<uint64_t> scratch;
+    for (size_t i = 0; i + 1 < offsets.size(); i++) {
+      sortSegment(grains.data() + offsets[i], offsets[i + 1] - offsets[i],
+                  scratch);
+    }
   }
 
   virtual Crystal selectBestCrystal(std::vector<Crystal>& crystals) {
     if (crystals.size() == 0) throw std::exception();
-    Crystal best = crystals[0];
-    for (size_t i = 1; i < crystals.size(); i++) {
-      best = best < crystals[i] ? crystals[i] : best;
-    }
-    return best;
+    return bestCrystal(crystals.data(), crystals.size(), crystalComparison);
+  }
+
+  virtual size_t findBestCrystal(const std::vector<Crystal>& crystals) {
+    if (crystals.size() == 0) throw std::exception();
+    return bestCrystalPosition(crystals.data(), 0, crystals.size(),
+                               crystalComparison);
+  }
+
+  virtual std::vector<size_t> selectBestCrystals(
+      const std::vector<Crystal>& crystals, size_t k) {
+    return rankCrystals(crystals.data(),
+                        bestCrystalPositions(crystals.data(), 0,
+                                             crystals.size(), k,
+                                             crystalComparison),
+                        k, crystalComparison);
+  }
+
+  virtual CrystalSurvey surveyCrystals(const std::vector<Crystal>& crystals,
+                                       unsigned statistics, size_t buckets = 0,
+                                       uint64_t bucketWidth = 1) {
+    if (crystals.size() == 0) throw std::exception();
+    checkSurvey(statistics, buckets, bucketWidth);
+    return surveyRange(crystals.data(), 0, crystals.size(), statistics,
+                       buckets, bucketWidth);
+  }
+
+  virtual std::unique_ptr<CrystalStream> streamCrystals() {
+    return std::unique_ptr<CrystalStream>(
+        new CrystalStream(nullptr, crystalComparison));
+  }
+
+  virtual std::unique_ptr<CrystalTournament> holdCrystalTournament(
+      const std::vector<Crystal>& crystals) {
+    return std::unique_ptr<CrystalTournament>(
+        new CrystalTournament(crystals, nullptr));
   }
 };
 
 class TeamAdventure : public Adventure {
+ public:
+  // merge sort variants used by arrangeSand
+  enum class SortMode {
+    // merges halves with std::inplace_merge, which allocates its own buffer
+    kInplaceMerge,
+    // merges between grains and one preallocated scratch vector,
+    // alternating source and destination between levels
+    kPingPong,
+    // detects existing ascending and descending runs and merges them in
+    // powersort order, approaching O(n) comparisons on nearly sorted input
+    kAdaptive,
+    // merges in place by co-ranking and rotation, with one scratch area of
+    // about sqrt(n) grains per shaman
+    kInPlace
+  };
+
  private:
+  // the work of every call is split among at most this many shamans
   uint64_t numberOfShamans;
-  ThreadPool councilOfShamans;
+  // the adventure's own council, or one it shares with other adventures
+  std::shared_ptr<ThreadPool> council;
+  ThreadPool& councilOfShamans;
+  SortMode sortMode;
+  bool hotPacking;
+  // pinned shamans first touch the columns of the packEggs rows they later
+  // fill; the sorts steal their work, so no shaman owns a block of them
+  bool firstTouch;
+  // every task of this adventure goes through its budget, since every
+  // calling thread is a shaman too
+  ShamanBudget budget;
+
+  // help function for the constructors
+  static size_t councilSize(const std::shared_ptr<ThreadPool>& councilArg) {
+    if (!councilArg) throw std::invalid_argument("no council to join");
+    return councilArg->size();
+  }
 
  public:
-  explicit TeamAdventure(uint64_t numberOfShamansArg)
+  // queueBackendArg picks how tasks of callers outside the council reach it,
+  // pinningArg where the shamans run
+  explicit TeamAdventure(
+      uint64_t numberOfShamansArg,
+      queue_backend queueBackendArg = queue_backend::locked,
+      pinning pinningArg = pinning::none)
       : numberOfShamans(numberOfShamansArg),
-        councilOfShamans(numberOfShamansArg) {}
+        council(std::make_shared<ThreadPool>(
+            numberOfShamansArg, queueBackendArg,
+            ThreadPool::default_ring_capacity, pinningArg)),
+        councilOfShamans(*council),
+        sortMode(SortMode::kPingPong),
+        hotPacking(false),
+        firstTouch(pinningArg != pinning::none),
+        budget(&councilOfShamans, numberOfShamans) {}
+
+  // joins councilArg, e.g. sharedCouncil(), instead of raising a council of
+  // its own; the calling thread and at most numberOfShamansArg - 1 tasks
+  // work for a call, however many shamans the council has. Throws
+  // std::invalid_argument if councilArg is null.
+  TeamAdventure(uint64_t numberOfShamansArg,
+                std::shared_ptr<ThreadPool> councilArg)
+      : numberOfShamans(std::max<uint64_t>(
+            1, std::min<uint64_t>(numberOfShamansArg,
+                                  councilSize(councilArg) + 1))),
+        council(councilArg),
+        councilOfShamans(*council),
+        sortMode(SortMode::kPingPong),
+        hotPacking(false),
+        firstTouch(false),
+        budget(&councilOfShamans, numberOfShamans) {}
 
-  typedef std::vector<uint64_t> col;
+  // one council for the whole process. Every thread calling an adventure
+  // works as a shaman too, so the council has one thread fewer than the
+  // hardware and a single caller never oversubscribes the machine; use
+  // ThreadPool::set_active_workers to leave room for more callers
+  static std::shared_ptr<ThreadPool> sharedCouncil() {
+    static std::shared_ptr<ThreadPool> shared(new ThreadPool(
+        std::max<unsigned>(2, std::thread::hardware_concurrency()) - 1));
+    return shared;
+  }
+
+  void setSortMode(SortMode sortModeArg) { sortMode = sortModeArg; }
+
+  // how long idle shamans spin before they sleep; on a shared council this
+  // applies to all adventures sharing it
+  void setIdlePolicy(idle_policy idlePolicyArg) {
+    councilOfShamans.set_idle_policy(idlePolicyArg);
+  }
+
+  // keeps the shamans spinning for a whole packEggs call, so that they are
+  // awake for every row instead of being woken for each
+  void setHotPacking(bool hotPackingArg) { hotPacking = hotPackingArg; }
+
+  // leaves the elements of a vector unconstructed when it is sized, so that
+  // the shamans can construct, and thereby first touch, them
+  template <typename T>
+  struct LazyAllocator : std::allocator<T> {
+    template <typename U>
+    struct rebind {
+      typedef LazyAllocator<U> other;
+    };
+    LazyAllocator() {}
+    template <typename U>
+    LazyAllocator(const LazyAllocator<U>&) {}  //  NOLINT
+    template <typename U>
+    void construct(U*) {}
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+      ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+  };
+
+  typedef std::vector<uint64_t, LazyAllocator<uint64_t>> col;
   typedef std::vector<col> matrix;
-  typedef std::shared_ptr<matrix> shr;
 
   typedef std::vector<bool> colB;
   typedef std::vector<colB> matrixB;
-  typedef std::shared_ptr<matrixB> shrB;
 
-  // help function for packEggs
-  static void findEgg(const uint64_t& len, const uint64_t& e, size_t f,
-                      size_t r, shr A, shrB B, std::vector<Egg>& eggs,
-                      TeamAdventure* team, uint64_t sha) {
-    if (r - f <= len) {
-      for (uint64_t i = f; i <= r; i++) {
-        uint64_t size = eggs[e - 1].getSize();
-        if (size > i) {
-          A->at(e)[i] = A->at(e - 1)[i];
-        } else {
-          A->at(e)[i] = std::max(A->at(e - 1)[i], A->at(e - 1)[i - size] +
-                                                      eggs[e - 1].getWeight());
-          if (A->at(e)[i] > A->at(e - 1)[i]) B->at(e)[i] = true;
-        }
+  // help function for packEggs, fills row e of A and B for sizes [f, r)
+  static void findEgg(uint64_t e, size_t f, size_t r, matrix& A, matrixB& B,
+                      std::vector<Egg>& eggs) {
+    for (uint64_t i = f; i < r; i++) {
+      uint64_t size = eggs[e - 1].getSize();
+      if (size > i) {
+        A[e][i] = A[e - 1][i];
+      } else {
+        A[e][i] = std::max(A[e - 1][i],
+                           A[e - 1][i - size] + eggs[e - 1].getWeight());
+        if (A[e][i] > A[e - 1][i]) B[e][i] = true;
       }
-    } else {
-      uint64_t floor = sha / 2;
-      uint64_t m = (r - f) * floor / sha + f;
-      uint64_t help = sha;
-      sha /= 2;
-      auto x = team->councilOfShamans.enqueue(findEgg, len, e, f, m, A, B, eggs,
-                                              team, sha);
-      findEgg(len, e, m + 1, r, A, B, eggs, team, help - sha);
-      x.wait();
     }
   }
   // names of variables as in LonesomeAdventure
   uint64_t packEggs(std::vector<Egg>& eggs, BottomlessBag& bag) {
     uint64_t S = bag.getCapacity() + 1;
     uint64_t n = eggs.size() + 1;
-    const uint64_t len = S / numberOfShamans + 1;
-    auto A = std::make_shared<matrix>(n, col(S, 0));
-    auto B = std::make_shared<matrixB>(n, colB(S, false));
+    // one chunk per shaman, in whole words of the bit rows of B so that no
+    // two shamans write the same word
+    const uint64_t len = (S / numberOfShamans + 64) / 64 * 64;
+    matrix A(n);
+    if (firstTouch) {
+      // every shaman places the columns it fills, of all rows
+      for (col& row : A) row.resize(S);
+      councilOfShamans.parallel_for_static(0, S, 64, [&](size_t f, size_t r) {
+        for (col& row : A) std::fill(row.begin() + f, row.begin() + r, 0);
+      });
+    } else {
+      for (col& row : A) row.assign(S, 0);
+    }
+    matrixB B(n, colB(S, false));
+    std::unique_ptr<ThreadPool::hot_section> hot(
+        hotPacking ? new ThreadPool::hot_section(councilOfShamans) : nullptr);
     for (uint64_t i = 1; i < n; i++) {
-      this->councilOfShamans
-          .enqueue(findEgg, len, i, 0, S - 1, A, B, eggs, this, numberOfShamans)
-          .wait();
+      auto fill = [&](size_t f, size_t r) { findEgg(i, f, r, A, B, eggs); };
+      if (firstTouch) {
+        councilOfShamans.parallel_for_static(0, S, 64, fill);
+      } else {
+        budget.shareLoop(0, S, len, fill);
+      }
     }
     uint64_t s = S - 1;
     uint64_t i = n - 1;
     while (i != 0) {
-      if (B->at(i)[s]) {
+      if (B[i][s]) {
         bag.addEgg(eggs[i - 1]);
         s -= eggs[i - 1].getSize();
       }
       i--;
     }
-    return A->at(n - 1)[S - 1];
+    return A[n - 1][S - 1];
   }
   // help function for arrangeSand
   static void sortGrains(const uint64_t& len, size_t f, size_t r,
@@ -149,52 +1051,887 @@ class TeamAdventure : public Adventure {
       uint64_t m = (r - f) * floor / sha + f;
       uint64_t help = sha;
       sha /= 2;
-      auto x = team->councilOfShamans.enqueue(sortGrains, len, f, m, grains,
-                                              team, sha);
+      auto x = team->budget.fork(sortGrains, len, f, m, grains, team, sha);
       sortGrains(len, m + 1, r, grains, team, help - sha);
-      x.wait();
-      std::vector<GrainOfSand> full;
+      team->councilOfShamans.wait(x);
       std::inplace_merge(
           grains->begin() + f, grains->begin() + m + 1, grains->begin() + r + 1,
           [](const GrainOfSand& a, const GrainOfSand& b) { return (a < b); });
     }
   }
+  // help function for arrangeSand in SortMode::kPingPong
+  // sorts [f, r] leaving the result in dst if toDst is set, in src otherwise;
+  // children sort into the opposite buffer, so every level is a single merge
+  // and no level copies back
+  static void sortGrainsPingPong(const uint64_t& len, size_t f, size_t r,
+                                 GrainOfSand* src, GrainOfSand* dst, bool toDst,
+                                 TeamAdventure* team, uint64_t sha) {
+    uint64_t* from = GrainOfSand::sizes(toDst ? src : dst);
+    uint64_t* to = GrainOfSand::sizes(toDst ? dst : src);
+    if (r - f <= len) {
+      // the buffer not holding the result is free scratch at this point
+      if (toDst) std::copy(src + f, src + r + 1, dst + f);
+      sortKeys(to + f, r - f + 1, from + f);
+    } else {
+      uint64_t floor = sha / 2;
+      uint64_t m = (r - f) * floor / sha + f;
+      uint64_t help = sha;
+      sha /= 2;
+      auto x = team->budget.fork(sortGrainsPingPong, len, f, m, src, dst,
+                                 !toDst, team, sha);
+      sortGrainsPingPong(len, m + 1, r, src, dst, !toDst, team, help - sha);
+      team->councilOfShamans.wait(x);
+      mergeKeys(from + f, m - f + 1, from + m + 1, r - m, to + f);
+    }
+  }
+
+  // help function for arrangeSand in SortMode::kInPlace
+  // number i of keys taken from [f, m) when the k smallest of the sorted runs
+  // [f, m) and [m, r) are [f, f + i) and [m, m + k - i), ties from [f, m)
+  static size_t coRank(const uint64_t* keys, size_t f, size_t m, size_t r,
+                       size_t k) {
+    size_t lo = k > r - m ? k - (r - m) : 0, hi = std::min(k, m - f);
+    while (lo < hi) {
+      size_t i = lo + (hi - lo) / 2;
+      if (keys[m + k - i - 1] < keys[f + i]) {
+        hi = i;
+      } else {
+        lo = i + 1;
+      }
+    }
+    return lo;
+  }
+
+  // help function for arrangeSand in SortMode::kInPlace
+  // merges the sorted runs [f, m) and [m, r) through buffer, which holds the
+  // shorter of them
+  static void mergeBuffered(uint64_t* keys, size_t f, size_t m, size_t r,
+                            uint64_t* buffer) {
+    if (m - f <= r - m) {
+      uint64_t* a = std::copy(keys + f, keys + m, buffer);
+      uint64_t *i = buffer, *j = keys + m, *out = keys + f;
+      while (i != a && j != keys + r) *out++ = *j < *i ? *j++ : *i++;
+      std::copy(i, a, out);
+    } else {
+      uint64_t* b = std::copy(keys + m, keys + r, buffer);
+      uint64_t *i = keys + m, *j = b, *out = keys + r;
+      while (i != keys + f && j != buffer) {
+        *--out = *(j - 1) < *(i - 1) ? *--i : *--j;
+      }
+      std::copy_backward(buffer, j, out);
+    }
+  }
+
+  // help function for arrangeSand in SortMode::kInPlace
+  // merges the sorted runs [f, m) and [m, r) in place: the output is split
+  // at its middle by co-ranking and one rotation turns A1 A2 B1 B2 into two
+  // independent merges A1 B1 and A2 B2, which the shamans share while there
+  // are more of them; buffer holds bufferSize keys per shaman
+  static void mergeInPlace(size_t f, size_t m, size_t r, uint64_t* keys,
+                           uint64_t* buffer, size_t bufferSize,
+                           TeamAdventure* team, uint64_t sha) {
+    if (f == m || m == r || !(keys[m] < keys[m - 1])) return;
+    if (sha == 1 && std::min(m - f, r - m) <= bufferSize) {
+      mergeBuffered(keys, f, m, r, buffer);
+      return;
+    }
+    size_t k = (r - f) / 2;
+    size_t i = coRank(keys, f, m, r, k);
+    std::rotate(keys + f + i, keys + m, keys + m + k - i);
+    size_t left = f + i, mid = f + k, right = mid + (m - f - i);
+    if (sha > 1) {
+      uint64_t help = sha;
+      sha /= 2;
+      auto x = team->budget.fork(mergeInPlace, f, left, mid, keys, buffer,
+                                 bufferSize, team, sha);
+      mergeInPlace(mid, right, r, keys, buffer + sha * bufferSize, bufferSize,
+                   team, help - sha);
+      team->councilOfShamans.wait(x);
+    } else {
+      mergeInPlace(f, left, mid, keys, buffer, bufferSize, team, 1);
+      mergeInPlace(mid, right, r, keys, buffer, bufferSize, team, 1);
+    }
+  }
+
+  // help function for arrangeSand in SortMode::kInPlace
+  // every subtree owns the buffers of its shamans
+  static void sortGrainsInPlace(const uint64_t& len, size_t f, size_t r,
+                                uint64_t* keys, uint64_t* buffer,
+                                size_t bufferSize, TeamAdventure* team,
+                                uint64_t sha) {
+    if (r - f <= len) {
+      std::sort(keys + f, keys + r + 1);
+    } else {
+      uint64_t floor = sha / 2;
+      uint64_t m = (r - f) * floor / sha + f;
+      uint64_t help = sha;
+      sha /= 2;
+      auto x = team->budget.fork(sortGrainsInPlace, len, f, m, keys, buffer,
+                                 bufferSize, team, sha);
+      sortGrainsInPlace(len, m + 1, r, keys, buffer + sha * bufferSize,
+                        bufferSize, team, help - sha);
+      team->councilOfShamans.wait(x);
+      mergeInPlace(f, m + 1, r + 1, keys, buffer, bufferSize, team, help);
+    }
+  }
+
+  // runs shorter than this are extended with binary insertion sort
+  static const size_t minRun = 32;
+
+  // help function for arrangeSand in SortMode::kAdaptive
+  // splits [f, r] into runs, reversing strictly descending ones and extending
+  // short ones to minRun; returns the starts of the runs
+  static std::vector<size_t> findRuns(size_t f, size_t r, GrainOfSand* grains) {
+    std::vector<size_t> starts;
+    size_t s = f;
+    while (s <= r) {
+      size_t e = s + 1;
+      if (e <= r && grains[e] < grains[s]) {
+        while (e + 1 <= r && grains[e + 1] < grains[e]) e++;
+        std::reverse(grains + s, grains + e + 1);
+      } else {
+        while (e <= r && !(grains[e] < grains[e - 1])) e++;
+        e--;
+      }
+      // [s, e] is sorted now
+      size_t end = std::min(r, s + minRun - 1);
+      for (e++; e <= end; e++) {
+        GrainOfSand* pos = std::upper_bound(grains + s, grains + e, grains[e]);
+        std::rotate(pos, grains + e, grains + e + 1);
+      }
+      starts.push_back(s);
+      s = e;
+    }
+    return starts;
+  }
+
+  // powersort priority of the boundary between runs [s1, s2) and [s2, e2)
+  // within n grains: the first bit in which the run midpoints, as fractions
+  // of n, differ
+  static uint64_t runPower(size_t s1, size_t s2, size_t e2, size_t n) {
+    uint64_t a = s1 + s2, b = s2 + e2, twoN = 2 * n;
+    uint64_t power = 0;
+    for (;;) {
+      power++;
+      a <<= 1;
+      b <<= 1;
+      if ((a >= twoN) != (b >= twoN)) return power;
+      if (a >= twoN) {
+        a -= twoN;
+        b -= twoN;
+      }
+    }
+  }
+
+  // help function for arrangeSand in SortMode::kAdaptive
+  // merges runs i..j of starts, splitting at the boundary with the lowest
+  // power; buffers alternate between levels as in sortGrainsPingPong
+  static void mergeRuns(const std::vector<size_t>* starts,
+                        const std::vector<uint64_t>* powers, size_t i, size_t j,
+                        GrainOfSand* src, GrainOfSand* dst, bool toDst,
+                        TeamAdventure* team, uint64_t sha) {
+    size_t f = starts->at(i), r = starts->at(j + 1);
+    if (i == j) {
+      if (toDst) std::copy(src + f, src + r, dst + f);
+      return;
+    }
+    size_t k = i;
+    for (size_t b = i + 1; b < j; b++) {
+      if (powers->at(b) < powers->at(k)) k = b;
+    }
+    size_t m = starts->at(k + 1);
+    if (sha > 1) {
+      uint64_t help = sha;
+      sha /= 2;
+      auto x = team->budget.fork(mergeRuns, starts, powers, i, k, src, dst,
+                                 !toDst, team, sha);
+      mergeRuns(starts, powers, k + 1, j, src, dst, !toDst, team, help - sha);
+      team->councilOfShamans.wait(x);
+    } else {
+      mergeRuns(starts, powers, i, k, src, dst, !toDst, team, 1);
+      mergeRuns(starts, powers, k + 1, j, src, dst, !toDst, team, 1);
+    }
+    GrainOfSand* from = toDst ? src : dst;
+    GrainOfSand* to = toDst ? dst : src;
+    if (from[m] < from[m - 1]) {
+      uint64_t* keys = GrainOfSand::sizes(from);
+      mergeKeys(keys + f, m - f, keys + m, r - m, GrainOfSand::sizes(to) + f);
+    } else {
+      // runs already in order, which is the common case for sorted input
+      std::copy(from + f, from + r, to + f);
+    }
+  }
+
+  void arrangeSandAdaptive(std::vector<GrainOfSand>& grains) {
+    const size_t n = grains.size();
+    const uint64_t len = n / numberOfShamans + 1;
+    std::vector<std::future<std::vector<size_t>>> scans;
+    for (size_t f = 0; f < n; f += len) {
+      scans.push_back(budget.dispatch(findRuns, f, std::min(n, f + len) - 1,
+                                      grains.data()));
+    }
+    std::vector<size_t> starts;
+    for (auto& scan : scans) {
+      std::vector<size_t> chunk = scan.get();
+      starts.insert(starts.end(), chunk.begin(), chunk.end());
+    }
+    starts.push_back(n);
+    std::vector<uint64_t> powers(starts.size() - 2);
+    for (size_t b = 0; b < powers.size(); b++) {
+      powers[b] = runPower(starts[b], starts[b + 1], starts[b + 2], n);
+    }
+    if (powers.empty()) return;
+    std::vector<GrainOfSand> scratch(n);
+    mergeRuns(&starts, &powers, 0, starts.size() - 2, grains.data(),
+              scratch.data(), false, this, numberOfShamans);
+  }
 
   virtual void arrangeSand(std::vector<GrainOfSand>& grains) {
+    if (grains.size() < 2) return;
     const uint64_t len = grains.size() / numberOfShamans + 1;
-    sortGrains(len, 0, grains.size() - 1, &grains, this, numberOfShamans);
+    if (sortMode == SortMode::kAdaptive) {
+      arrangeSandAdaptive(grains);
+    } else if (sortMode == SortMode::kInPlace) {
+      // numberOfShamans * sqrt(n) keys, a few MB even for huge inputs
+      const size_t bufferSize = std::min<size_t>(
+          1 << 16, std::sqrt(static_cast<double>(grains.size())) + 1);
+      std::vector<uint64_t> buffer(numberOfShamans * bufferSize);
+      sortGrainsInPlace(len, 0, grains.size() - 1,
+                        GrainOfSand::sizes(grains.data()), buffer.data(),
+                        bufferSize, this, numberOfShamans);
+    } else if (sortMode == SortMode::kPingPong) {
+      // the only allocation of the whole sort
+      std::vector<GrainOfSand> scratch(grains.size());
+      sortGrainsPingPong(len, 0, grains.size() - 1, grains.data(),
+                         scratch.data(), false, this, numberOfShamans);
+    } else {
+      sortGrains(len, 0, grains.size() - 1, &grains, this, numberOfShamans);
+    }
   }
 
-  // help function for selectBestCrystal
-  static Crystal findCrystal(const uint64_t& len, size_t f, size_t r,
-                             std::vector<Crystal>& crystals,
-                             TeamAdventure* team, uint64_t sha) {
+  // help function for arrangeSandOrder
+  // ping-pong merge sort as in sortGrainsPingPong, for any element type
+  template <typename T>
+  static void sortPingPong(const uint64_t& len, size_t f, size_t r, T* src,
+                           T* dst, bool toDst, TeamAdventure* team,
+                           uint64_t sha) {
+    T* from = toDst ? src : dst;
+    T* to = toDst ? dst : src;
     if (r - f <= len) {
-      auto best = crystals[f];
-      auto s = crystals.size();
-      for (uint64_t i = f + 1; i < r + 1 && i < s; i++) {
-        best = best < crystals[i] ? crystals[i] : best;
-      }
-      return best;
+      if (toDst) std::copy(src + f, src + r + 1, dst + f);
+      std::sort(to + f, to + r + 1);
     } else {
       uint64_t floor = sha / 2;
       uint64_t m = (r - f) * floor / sha + f;
       uint64_t help = sha;
       sha /= 2;
-      auto x = team->councilOfShamans.enqueue(findCrystal, len, f, m, crystals,
-                                              team, sha);
-      auto y = findCrystal(len, m + 1, r, crystals, team, help - sha);
-      auto z = x.get();
-      return z < y ? y : z;
+      auto x = team->budget.fork(sortPingPong<T>, len, f, m, src, dst, !toDst,
+                                 team, sha);
+      sortPingPong(len, m + 1, r, src, dst, !toDst, team, help - sha);
+      team->councilOfShamans.wait(x);
+      std::merge(from + f, from + m + 1, from + m + 1, from + r + 1, to + f);
+    }
+  }
+
+  // help function for arrangeSandOrder
+  // out[i] = grains[order[i]] for i in [f, r), one tile at a time so that
+  // the reads of a tile are in flight together
+  template <typename Index>
+  static void permuteGrains(const GrainOfSand* grains, const Index* order,
+                            size_t f, size_t r, GrainOfSand* out) {
+    const size_t tile = 64;
+    for (size_t t = f; t < r; t += tile) {
+      size_t e = std::min(r, t + tile);
+      for (size_t i = t; i < e; i++) __builtin_prefetch(grains + order[i]);
+      for (size_t i = t; i < e; i++) out[i] = grains[order[i]];
+    }
+  }
+
+  // sorts compact (size, position) pairs in parallel instead of the grains,
+  // then gathers the grains once in parallel blocks if asked to
+  template <typename Index>
+  void arrangeSandOrderOf(std::vector<GrainOfSand>& grains,
+                          std::vector<Index>& order, bool apply) {
+    const size_t n = grains.size(), len = n / numberOfShamans + 1;
+    if (n > 0 && n - 1 > std::numeric_limits<Index>::max()) {
+      throw std::length_error("too many grains for index type");
+    }
+    typedef std::pair<uint64_t, Index> sandKey;
+    std::vector<sandKey> keys(n), scratch(n);
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = sandKey(grains[i].getSize(), static_cast<Index>(i));
+    }
+    if (n > 1) {
+      sortPingPong(len, 0, n - 1, keys.data(), scratch.data(), false, this,
+                   numberOfShamans);
+    }
+    order.resize(n);
+    for (size_t i = 0; i < n; i++) order[i] = keys[i].second;
+    if (!apply) return;
+    std::vector<GrainOfSand> arranged(n);
+    std::vector<std::future<void>> gathers;
+    for (size_t f = 0; f < n; f += len) {
+      gathers.push_back(budget.dispatch(permuteGrains<Index>, grains.data(),
+                                        order.data(), f, std::min(n, f + len),
+                                        arranged.data()));
+    }
+    for (auto& gather : gathers) gather.get();
+    grains.swap(arranged);
+  }
+
+  virtual void arrangeSandOrder(std::vector<GrainOfSand>& grains,
+                                std::vector<uint32_t>& order, bool apply) {
+    arrangeSandOrderOf(grains, order, apply);
+  }
+
+  virtual void arrangeSandOrder(std::vector<GrainOfSand>& grains,
+                                std::vector<uint64_t>& order, bool apply) {
+    arrangeSandOrderOf(grains, order, apply);
+  }
+
+  typedef std::pair<GrainOfSand*, size_t> segment;
+
+  // segments longer than this are sorted by the parallel engine
+  static const size_t smallSegment = 4096;
+
+  // help function for the segmented sorts
+  // sorts the small segments among [f, r), one after another
+  static void sortSmallSegments(const segment* segments, size_t f, size_t r) {
+    std::vector<uint64_t> scratch;
+    for (size_t i = f; i < r; i++) {
+      if (segments[i].second <= smallSegment) {
+        LonesomeAdventure::sortSegment(segments[i].first, segments[i].second,
+                                       scratch);
+      }
+    }
+  }
+
+  // small segments are packed into one task per shaman by total size, so a
+  // three-grain segment costs no spawn of its own; large segments meanwhile
+  // go one by one through the ping-pong sort
+  void arrangeSegments(const std::vector<segment>& segments) {
+    size_t small = 0, large = 0;
+    for (auto& s : segments) {
+      if (s.second <= smallSegment) {
+        small += s.second;
+      } else {
+        large = std::max(large, s.second);
+      }
+    }
+    const size_t share = small / numberOfShamans + 1;
+    std::vector<std::future<void>> tasks;
+    size_t f = 0, packed = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+      if (segments[i].second <= smallSegment) packed += segments[i].second;
+      if (packed >= share || i + 1 == segments.size()) {
+        tasks.push_back(
+            budget.dispatch(sortSmallSegments, segments.data(), f, i + 1));
+        f = i + 1;
+        packed = 0;
+      }
+    }
+    std::vector<GrainOfSand> scratch(large);
+    for (auto& s : segments) {
+      if (s.second > smallSegment) {
+        sortGrainsPingPong(s.second / numberOfShamans + 1, 0, s.second - 1,
+                           s.first, scratch.data(), false, this,
+                           numberOfShamans);
+      }
+    }
+    for (auto& task : tasks) task.get();
+  }
+
+  virtual void arrangeSandBatch(
+      std::vector<std::vector<GrainOfSand>>& batches) {
+    std::vector<segment> segments;
+    segments.reserve(batches.size());
+    for (auto& grains : batches) {
+      segments.push_back(segment(grains.data(), grains.size()));
+    }
+    arrangeSegments(segments);
+  }
+
+  virtual void arrangeSandSegments(std::vector<GrainOfSand>& grains,
+                                   const std::vector<size_t>& offsets) {
+    checkSegments(grains, offsets);
+    std::vector<segment> segments;
+    for (size_t i = 0; i + 1 < offsets.size(); i++) {
+      segments.push_back(
+          segment(grains.data() + offsets[i], offsets[i + 1] - offsets[i]));
+    }
+    arrangeSegments(segments);
+  }
+
+  // help function for the rank queries
+  // counts grains of [f, r) smaller than low and those in [low, high]
+  static std::pair<size_t, size_t> countGrains(const GrainOfSand* grains,
+                                               size_t f, size_t r, uint64_t low,
+                                               uint64_t high) {
+    std::pair<size_t, size_t> counts(0, 0);
+    for (size_t i = f; i < r; i++) {
+      uint64_t size = grains[i].getSize();
+      if (size < low) {
+        counts.first++;
+      } else if (size <= high) {
+        counts.second++;
+      }
+    }
+    return counts;
+  }
+
+  // help function for the rank queries
+  // stable three-way split of [f, r) around [low, high] into out, grains of
+  // each class going to consecutive positions starting at its offset
+  static void splitGrains(const GrainOfSand* grains, size_t f, size_t r,
+                          uint64_t low, uint64_t high, GrainOfSand* out,
+                          size_t below, size_t within, size_t above) {
+    for (size_t i = f; i < r; i++) {
+      uint64_t size = grains[i].getSize();
+      if (size < low) {
+        out[below++] = grains[i];
+      } else if (size <= high) {
+        out[within++] = grains[i];
+      } else {
+        out[above++] = grains[i];
+      }
+    }
+  }
+
+  // help function for the rank queries
+  // collects grains of [f, r) not greater than high, in input order
+  static std::vector<GrainOfSand> gatherGrains(const GrainOfSand* grains,
+                                               size_t f, size_t r,
+                                               uint64_t high) {
+    std::vector<GrainOfSand> gathered;
+    for (size_t i = f; i < r; i++) {
+      if (grains[i].getSize() <= high) gathered.push_back(grains[i]);
+    }
+    return gathered;
+  }
+
+  // sizes expected to bracket ranks [lo, hi) of grains, read off a sorted
+  // sample with slack samples of margin on both sides
+  std::pair<uint64_t, uint64_t> rankSplitters(const GrainOfSand* grains,
+                                              size_t n, size_t lo, size_t hi,
+                                              size_t slack) {
+    const size_t s = std::min<size_t>(n, 256 * numberOfShamans);
+    std::minstd_rand random(n);
+    std::vector<uint64_t> sample(s);
+    for (size_t i = 0; i < s; i++) {
+      size_t f = i * n / s, r = (i + 1) * n / s;
+      sample[i] = grains[f + random() % (r - f)].getSize();
     }
+    std::sort(sample.begin(), sample.end());
+    size_t l = lo * s / n, h = (hi * s + n - 1) / n + slack;
+    uint64_t low = lo == 0 || l < slack ? 0 : sample[l - slack];
+    uint64_t high = hi == n || h >= s ? UINT64_MAX : sample[h];
+    return std::make_pair(low, high);
+  }
+
+  // counts of grains below and within splitters bracketing ranks [lo, hi),
+  // widening the bracket until it holds them; counts[c] belong to chunk c
+  std::pair<uint64_t, uint64_t> bracketRanks(
+      const std::vector<GrainOfSand>& grains, size_t lo, size_t hi,
+      std::vector<std::pair<size_t, size_t>>& counts) {
+    const size_t n = grains.size(), len = n / numberOfShamans + 1;
+    for (size_t slack = 2;; slack *= 4) {
+      std::pair<uint64_t, uint64_t> splitters =
+          rankSplitters(grains.data(), n, lo, hi, slack);
+      std::vector<std::future<std::pair<size_t, size_t>>> scans;
+      for (size_t f = 0; f < n; f += len) {
+        scans.push_back(budget.dispatch(countGrains, grains.data(), f,
+                                        std::min(n, f + len), splitters.first,
+                                        splitters.second));
+      }
+      size_t below = 0, within = 0;
+      counts.clear();
+      for (auto& scan : scans) {
+        counts.push_back(scan.get());
+        below += counts.back().first;
+        within += counts.back().second;
+      }
+      if (below <= lo && below + within >= hi) return splitters;
+    }
+  }
+
+  // sorts the grains of ranks [lo, hi) into place, with no bigger grain
+  // before and no smaller one after them; only the bucket between sampled
+  // splitters is sorted
+  void arrangeRanks(std::vector<GrainOfSand>& grains, size_t lo, size_t hi) {
+    const size_t n = grains.size(), len = n / numberOfShamans + 1;
+    if (lo >= hi) return;
+    std::vector<std::pair<size_t, size_t>> counts;
+    std::pair<uint64_t, uint64_t> splitters =
+        bracketRanks(grains, lo, hi, counts);
+    size_t below = 0, within = 0, above = 0;
+    for (auto& count : counts) {
+      within += count.first;
+      above += count.first + count.second;
+    }
+    const size_t f = within, r = above;
+    std::vector<GrainOfSand> scratch(n);
+    std::vector<std::future<void>> splits;
+    for (size_t c = 0; c < counts.size(); c++) {
+      splits.push_back(budget.dispatch(
+          splitGrains, grains.data(), c * len, std::min(n, (c + 1) * len),
+          splitters.first, splitters.second, scratch.data(), below, within,
+          above));
+      below += counts[c].first;
+      within += counts[c].second;
+      above += len - counts[c].first - counts[c].second;
+    }
+    for (auto& split : splits) split.get();
+    std::copy(scratch.begin(), scratch.begin() + f, grains.begin());
+    std::copy(scratch.begin() + r, scratch.end(), grains.begin() + r);
+    if (f < r) {
+      sortGrainsPingPong((r - f) / numberOfShamans + 1, f, r - 1,
+                         scratch.data(), grains.data(), true, this,
+                         numberOfShamans);
+    }
+  }
+
+  virtual void arrangeSandPartially(std::vector<GrainOfSand>& grains,
+                                    size_t k) {
+    arrangeRanks(grains, 0, std::min(k, grains.size()));
+  }
+
+  virtual GrainOfSand findGrainOfRank(std::vector<GrainOfSand>& grains,
+                                      size_t rank) {
+    if (rank >= grains.size()) throw std::out_of_range("no grain of rank");
+    arrangeRanks(grains, rank, rank + 1);
+    return grains[rank];
+  }
+
+  virtual std::vector<GrainOfSand> selectSmallestGrains(
+      const std::vector<GrainOfSand>& grains, size_t k) {
+    const size_t n = grains.size(), len = n / numberOfShamans + 1;
+    k = std::min(k, n);
+    if (k == 0) return std::vector<GrainOfSand>();
+    std::vector<std::pair<size_t, size_t>> counts;
+    uint64_t high = bracketRanks(grains, 0, k, counts).second;
+    std::vector<std::future<std::vector<GrainOfSand>>> gathers;
+    for (size_t f = 0; f < n; f += len) {
+      gathers.push_back(budget.dispatch(gatherGrains, grains.data(), f,
+                                        std::min(n, f + len), high));
+    }
+    std::vector<GrainOfSand> smallest;
+    for (auto& gather : gathers) {
+      std::vector<GrainOfSand> chunk = gather.get();
+      smallest.insert(smallest.end(), chunk.begin(), chunk.end());
+    }
+    std::stable_sort(smallest.begin(), smallest.end(), GrainOfSand::bySize);
+    smallest.resize(k);
+    return smallest;
+  }
+
+  typedef std::unique_ptr<std::FILE, int (*)(std::FILE*)> sandFile;
+
+  static sandFile openSand(const std::string& path, const char* mode) {
+    sandFile file(std::fopen(path.c_str(), mode), std::fclose);
+    if (!file) throw std::runtime_error("cannot open " + path);
+    return file;
+  }
+
+  // closes a file that was written to, so that a write failing only once
+  // the buffer is flushed is not lost
+  static void closeSand(sandFile file) {
+    std::FILE* raw = file.release();
+    bool flushed = std::fflush(raw) == 0;
+    if (std::fclose(raw) != 0 || !flushed) {
+      throw std::runtime_error("cannot write sand");
+    }
+  }
+
+  // run files of arrangeSandFile, removed however it ends
+  struct sandRuns {
+    std::vector<std::string> paths;
+    ~sandRuns() {
+      for (auto& path : paths) std::remove(path.c_str());
+    }
+  };
+
+  // reads up to count grains, returns the number of grains read
+  static size_t readSand(std::FILE* file, GrainOfSand* grains, size_t count) {
+    size_t read = std::fread(GrainOfSand::sizes(grains), sizeof(uint64_t),
+                             count, file);
+    if (read < count && std::ferror(file)) {
+      throw std::runtime_error("cannot read sand");
+    }
+    return read;
+  }
+
+  static void writeSand(std::FILE* file, const uint64_t* sizes, size_t count) {
+    if (std::fwrite(sizes, sizeof(uint64_t), count, file) != count) {
+      throw std::runtime_error("cannot write sand");
+    }
+  }
+
+  static void seekSand(std::FILE* file, uint64_t grain) {
+    if (fseeko(file, grain * sizeof(uint64_t), SEEK_SET) != 0) {
+      throw std::runtime_error("cannot seek sand");
+    }
+  }
+
+  // position of the first grain not smaller than size in a sorted run file
+  static uint64_t lowerBoundInRun(std::FILE* run, uint64_t n, uint64_t size) {
+    uint64_t f = 0, r = n;
+    while (f < r) {
+      uint64_t m = f + (r - f) / 2;
+      GrainOfSand grain;
+      seekSand(run, m);
+      if (readSand(run, &grain, 1) != 1) {
+        throw std::runtime_error("run shorter than expected");
+      }
+      if (grain.getSize() < size) {
+        f = m + 1;
+      } else {
+        r = m;
+      }
+    }
+    return f;
+  }
+
+  // help function for arrangeSandFile
+  // k-way merges grains [from[i], to[i]) of every run i into output, starting
+  // at grain offset; every run and the output go through buffer-sized blocks
+  static void mergeSandRuns(const std::vector<std::string>* runs,
+                            std::vector<uint64_t> from,
+                            std::vector<uint64_t> to, uint64_t offset,
+                            const std::string* output, size_t buffer) {
+    const size_t k = runs->size();
+    std::vector<sandFile> files;
+    std::vector<std::vector<GrainOfSand>> blocks(k);
+    std::vector<size_t> pos(k, 0);
+    // (size, run) of the smallest unmerged grain of every non-empty run
+    typedef std::pair<uint64_t, size_t> head;
+    std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+    auto refill = [&](size_t i) {
+      size_t count = std::min<uint64_t>(buffer, to[i] - from[i]);
+      blocks[i].resize(count);
+      readSand(files[i].get(), blocks[i].data(), count);
+      from[i] += count;
+      pos[i] = 0;
+    };
+    for (size_t i = 0; i < k; i++) {
+      files.push_back(openSand(runs->at(i), "rb"));
+      seekSand(files[i].get(), from[i]);
+      refill(i);
+      if (!blocks[i].empty()) heads.push(head(blocks[i][0].getSize(), i));
+    }
+    sandFile out = openSand(*output, "r+b");
+    seekSand(out.get(), offset);
+    std::vector<uint64_t> written;
+    written.reserve(buffer);
+    while (!heads.empty()) {
+      head h = heads.top();
+      heads.pop();
+      written.push_back(h.first);
+      if (written.size() == buffer) {
+        writeSand(out.get(), written.data(), written.size());
+        written.clear();
+      }
+      size_t i = h.second;
+      if (++pos[i] == blocks[i].size()) refill(i);
+      if (pos[i] < blocks[i].size()) {
+        heads.push(head(blocks[i][pos[i]].getSize(), i));
+      }
+    }
+    writeSand(out.get(), written.data(), written.size());
+    closeSand(std::move(out));
+  }
+
+  // grains sorted in memory at a time by arrangeSandFile, 32 MB
+  static const size_t sandChunk = 1 << 22;
+
+  // sorts a binary file of 64-bit grain sizes that need not fit in memory:
+  // chunks are sorted by the shamans into run files next to output while the
+  // next chunk is read, then every shaman k-way merges one key range of all
+  // runs into its own part of output. Throws std::invalid_argument if
+  // chunkGrains is 0.
+  void arrangeSandFile(const std::string& input, const std::string& output,
+                       size_t chunkGrains = sandChunk) {
+    if (chunkGrains == 0) throw std::invalid_argument("empty sand chunks");
+    sandFile in = openSand(input, "rb");
+    sandRuns runFiles;
+    std::vector<std::string>& runs = runFiles.paths;
+    std::vector<uint64_t> runSizes, samples;
+    std::vector<GrainOfSand> chunk(chunkGrains), ahead(chunkGrains);
+    size_t count = readSand(in.get(), chunk.data(), chunkGrains);
+    while (count > 0) {
+      auto reading = std::async(std::launch::async, readSand, in.get(),
+                                ahead.data(), chunkGrains);
+      chunk.resize(count);
+      arrangeSand(chunk);
+      size_t stride = std::max<size_t>(1, count / (64 * numberOfShamans));
+      for (size_t i = 0; i < count; i += stride) {
+        samples.push_back(chunk[i].getSize());
+      }
+      runs.push_back(output + ".run" + std::to_string(runs.size()));
+      sandFile run = openSand(runs.back(), "wb");
+      writeSand(run.get(), GrainOfSand::sizes(chunk.data()), count);
+      closeSand(std::move(run));
+      runSizes.push_back(count);
+      count = reading.get();
+      chunk.swap(ahead);
+      ahead.resize(chunkGrains);
+    }
+    in.reset();
+    closeSand(openSand(output, "wb"));
+    if (runs.empty()) return;
+    // one part per shaman, split at sampled sizes; bounds[j][i] is where
+    // part j begins in run i
+    const size_t k = runs.size(), parts = numberOfShamans;
+    std::sort(samples.begin(), samples.end());
+    std::vector<std::vector<uint64_t>> bounds(parts + 1);
+    bounds[0].assign(k, 0);
+    bounds[parts] = runSizes;
+    for (size_t j = 1; j < parts; j++) {
+      uint64_t splitter = samples[j * samples.size() / parts];
+      for (size_t i = 0; i < k; i++) {
+        bounds[j].push_back(lowerBoundInRun(openSand(runs[i], "rb").get(),
+                                            runSizes[i], splitter));
+      }
+    }
+    const size_t buffer = std::max<size_t>(1024, chunkGrains / (k + 1) / parts);
+    std::vector<std::future<void>> merges;
+    uint64_t offset = 0;
+    // every merge reads runs and output, so none may outlive this call
+    try {
+      for (size_t j = 0; j < parts; j++) {
+        merges.push_back(budget.dispatch(mergeSandRuns, &runs, bounds[j],
+                                         bounds[j + 1], offset, &output,
+                                         buffer));
+        for (size_t i = 0; i < k; i++) {
+          offset += bounds[j + 1][i] - bounds[j][i];
+        }
+      }
+    } catch (...) {
+      for (auto& merge : merges) merge.wait();
+      throw;
+    }
+    for (auto& merge : merges) merge.wait();
+    for (auto& merge : merges) merge.get();
+  }
+
+  // a partial result alone on its cache lines
+  template <typename T>
+  struct lineSlot {
+    T value;
+    char padding[64];
+  };
+
+  // bounds of one contiguous chunk per shaman, cut at cache line boundaries
+  template <typename T>
+  std::vector<size_t> lineChunks(const T* data, size_t n) {
+    const size_t perLine = 64 / sizeof(T);
+    const size_t skew =
+        (64 - reinterpret_cast<uintptr_t>(data) % 64) % 64 / sizeof(T);
+    std::vector<size_t> bounds(1, 0);
+    for (size_t c = 1; c < numberOfShamans; c++) {
+      size_t b = c * n / numberOfShamans;
+      b = b < skew ? skew : skew + (b - skew + perLine - 1) / perLine * perLine;
+      if (b > bounds.back() && b < n) bounds.push_back(b);
+    }
+    bounds.push_back(n);
+    return bounds;
+  }
+
+  // help function for the crystal reductions: scan(f, r) of every chunk of
+  // lineChunks runs on the council and the caller, each into its own slot,
+  // and the results are folded with combine in chunk order
+  template <typename T, typename Scan, typename Combine>
+  T reduceCrystals(const std::vector<Crystal>& crystals, const Scan& scan,
+                   const Combine& combine) {
+    std::vector<size_t> bounds = lineChunks(crystals.data(), crystals.size());
+    const size_t chunks = bounds.size() - 1;
+    std::vector<lineSlot<T>> slots(chunks);
+    budget.shareLoop(0, chunks, 1, [&](size_t f, size_t r) {
+      for (size_t c = f; c < r; c++) {
+        slots[c].value = scan(bounds[c], bounds[c + 1]);
+      }
+    });
+    T result = std::move(slots[0].value);
+    for (size_t c = 1; c < chunks; c++) {
+      result = combine(std::move(result), slots[c].value);
+    }
+    return result;
   }
 
   virtual Crystal selectBestCrystal(std::vector<Crystal>& crystals) {
-    const uint64_t len = crystals.size() / numberOfShamans + 1;
-    return this->councilOfShamans
-        .enqueue(findCrystal, len, 0, crystals.size() - 1, crystals, this,
-                 numberOfShamans)
-        .get();
+    if (crystals.size() == 0) throw std::exception();
+    const Crystal* data = crystals.data();
+    const CrystalComparison comparison = crystalComparison;
+    return reduceCrystals<Crystal>(
+        crystals,
+        [data, comparison](size_t f, size_t r) {
+          return bestCrystal(data + f, r - f, comparison);
+        },
+        [](const Crystal& best, const Crystal& other) {
+          return best < other ? other : best;
+        });
+  }
+
+  virtual size_t findBestCrystal(const std::vector<Crystal>& crystals) {
+    if (crystals.size() == 0) throw std::exception();
+    const Crystal* data = crystals.data();
+    const CrystalComparison comparison = crystalComparison;
+    return reduceCrystals<size_t>(
+        crystals,
+        [data, comparison](size_t f, size_t r) {
+          return bestCrystalPosition(data, f, r, comparison);
+        },
+        [data, comparison](size_t best, size_t other) {
+          return ranksBefore(data, other, best, comparison) ? other : best;
+        });
+  }
+
+  // every shaman keeps a bounded heap over its chunk, and the at most k
+  // positions of every heap are ranked at the end
+  virtual std::vector<size_t> selectBestCrystals(
+      const std::vector<Crystal>& crystals, size_t k) {
+    if (crystals.size() == 0 || k == 0) return std::vector<size_t>();
+    const Crystal* data = crystals.data();
+    const CrystalComparison comparison = crystalComparison;
+    std::vector<size_t> candidates = reduceCrystals<std::vector<size_t>>(
+        crystals,
+        [data, k, comparison](size_t f, size_t r) {
+          return bestCrystalPositions(data, f, r, k, comparison);
+        },
+        [](std::vector<size_t> all, const std::vector<size_t>& heap) {
+          all.insert(all.end(), heap.begin(), heap.end());
+          return all;
+        });
+    return rankCrystals(data, candidates, k, comparison);
+  }
+
+  // every shaman surveys its chunk into its own partial survey, and the
+  // partial surveys are merged in chunk order
+  virtual CrystalSurvey surveyCrystals(const std::vector<Crystal>& crystals,
+                                       unsigned statistics, size_t buckets = 0,
+                                       uint64_t bucketWidth = 1) {
+    if (crystals.size() == 0) throw std::exception();
+    checkSurvey(statistics, buckets, bucketWidth);
+    const Crystal* data = crystals.data();
+    return reduceCrystals<CrystalSurvey>(
+        crystals,
+        [=](size_t f, size_t r) {
+          return surveyRange(data, f, r, statistics, buckets, bucketWidth);
+        },
+        [](CrystalSurvey survey, const CrystalSurvey& other) {
+          mergeSurveys(&survey, other);
+          return survey;
+        });
+  }
+
+  virtual std::unique_ptr<CrystalStream> streamCrystals() {
+    return std::unique_ptr<CrystalStream>(
+        new CrystalStream(&budget, crystalComparison));
+  }
+
+  virtual std::unique_ptr<CrystalTournament> holdCrystalTournament(
+      const std::vector<Crystal>& crystals) {
+    return std::unique_ptr<CrystalTournament>(
+        new CrystalTournament(crystals, &budget));
   }
 };
 #endif  // SRC_ADVENTURE_H_
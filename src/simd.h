@@ -0,0 +1,276 @@
+#ifndef SRC_SIMD_H_
+#define SRC_SIMD_H_
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstdint>
+
+// Vectorized kernels on unsigned 64-bit keys, selected at runtime.
+// AVX2 only compares signed 64-bit lanes, so keys have their top bit flipped
+// while they sit in registers.
+
+#define SIMD_AVX2 __attribute__((target("avx2")))
+#define SIMD_AVX512 __attribute__((target("avx512f")))
+
+inline bool hasAvx2() {
+  static const bool has =
+      (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+  return has;
+}
+
+inline bool hasAvx512() {
+  static const bool has =
+      (__builtin_cpu_init(), __builtin_cpu_supports("avx512f") != 0);
+  return has;
+}
+
+// a <- min(a, b), b <- max(a, b), lane by lane
+SIMD_AVX2 inline void minMaxAvx2(__m256i& a, __m256i& b) {
+  __m256i gt = _mm256_cmpgt_epi64(a, b);
+  __m256i lo = _mm256_blendv_epi8(a, b, gt);
+  b = _mm256_blendv_epi8(b, a, gt);
+  a = lo;
+}
+
+// sorts a register holding a bitonic sequence
+SIMD_AVX2 inline __m256i cleanLanesAvx2(__m256i v) {
+  __m256i lo = v, hi = _mm256_permute4x64_epi64(v, 0x4E);
+  minMaxAvx2(lo, hi);
+  v = _mm256_blend_epi32(lo, hi, 0xF0);
+  lo = v;
+  hi = _mm256_permute4x64_epi64(v, 0xB1);
+  minMaxAvx2(lo, hi);
+  return _mm256_blend_epi32(lo, hi, 0xCC);
+}
+
+// sorts the four lanes of a register
+SIMD_AVX2 inline __m256i sortLanesAvx2(__m256i v) {
+  __m256i lo = v, hi = _mm256_permute4x64_epi64(v, 0xB1);
+  minMaxAvx2(lo, hi);
+  // lanes 0, 1 ascending and lanes 2, 3 descending form a bitonic sequence
+  return cleanLanesAvx2(_mm256_blend_epi32(lo, hi, 0x3C));
+}
+
+// sorts k registers holding one bitonic sequence, k a power of two
+SIMD_AVX2 inline void bitonicCleanAvx2(__m256i* v, size_t k) {
+  for (size_t d = k / 2; d > 0; d /= 2) {
+    for (size_t i = 0; i < k; i++) {
+      if (!(i & d)) minMaxAvx2(v[i], v[i + d]);
+    }
+  }
+  for (size_t i = 0; i < k; i++) v[i] = cleanLanesAvx2(v[i]);
+}
+
+// bitonic merge of the sorted registers v[0, k) and v[k, 2k)
+SIMD_AVX2 inline void bitonicMergeAvx2(__m256i* v, size_t k) {
+  __m256i* b = v + k;
+  for (size_t i = 0; i < k / 2; i++) {
+    __m256i t = b[i];
+    b[i] = b[k - 1 - i];
+    b[k - 1 - i] = t;
+  }
+  for (size_t i = 0; i < k; i++) {
+    b[i] = _mm256_permute4x64_epi64(b[i], 0x1B);
+    minMaxAvx2(v[i], b[i]);
+  }
+  bitonicCleanAvx2(v, k);
+  bitonicCleanAvx2(b, k);
+}
+
+// sorting network for up to 4 * k keys (k = 2, 4, 8 gives 8, 16 and 32);
+// reads n keys from in and writes them sorted to out
+template <size_t k>
+SIMD_AVX2 void sortNetworkAvx2(const uint64_t* in, size_t n, uint64_t* out) {
+  const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+  alignas(32) uint64_t buf[4 * k];
+  __m256i v[k];
+  if (n < 4 * k) {
+    std::copy(in, in + n, buf);
+    std::fill(buf + n, buf + 4 * k, UINT64_MAX);
+    in = buf;
+  }
+  for (size_t i = 0; i < k; i++) {
+    const __m256i* from = reinterpret_cast<const __m256i*>(in + 4 * i);
+    v[i] = sortLanesAvx2(_mm256_xor_si256(_mm256_loadu_si256(from), bias));
+  }
+  for (size_t w = 1; w < k; w *= 2) {
+    for (size_t i = 0; i < k; i += 2 * w) bitonicMergeAvx2(v + i, w);
+  }
+  uint64_t* to = n < 4 * k ? buf : out;
+  for (size_t i = 0; i < k; i++) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(to + 4 * i),
+                        _mm256_xor_si256(v[i], bias));
+  }
+  if (n < 4 * k) std::copy(buf, buf + n, out);
+}
+
+// merges sorted a and b into out, four keys per step; out may not overlap
+SIMD_AVX2 inline void mergeKeysAvx2(const uint64_t* a, size_t na,
+                                    const uint64_t* b, size_t nb,
+                                    uint64_t* out) {
+  if (na < 4 || nb < 4) {
+    std::merge(a, a + na, b, b + nb, out);
+    return;
+  }
+  const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+  __m256i v[2];
+  v[0] = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a)), bias);
+  v[1] = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b)), bias);
+  size_t ia = 4, ib = 4;
+  for (;;) {
+    bitonicMergeAvx2(v, 1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+                        _mm256_xor_si256(v[0], bias));
+    out += 4;
+    // the next block comes from the run with the smaller head; if that run
+    // has no full block left, the rest is merged scalar
+    bool fromA = ib == nb || (ia < na && a[ia] <= b[ib]);
+    if (fromA ? ia + 4 > na : ib + 4 > nb) break;
+    const uint64_t* next = fromA ? a + ia : b + ib;
+    v[0] = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(next)), bias);
+    (fromA ? ia : ib) += 4;
+  }
+  uint64_t rest[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(rest),
+                      _mm256_xor_si256(v[1], bias));
+  for (size_t ir = 0; ir < 4;) {
+    if (ia < na && a[ia] < rest[ir] && (ib == nb || a[ia] <= b[ib])) {
+      *out++ = a[ia++];
+    } else if (ib < nb && b[ib] < rest[ir]) {
+      *out++ = b[ib++];
+    } else {
+      *out++ = rest[ir++];
+    }
+  }
+  std::merge(a + ia, a + na, b + ib, b + nb, out);
+}
+
+// sorts 32-key blocks with the network, then merges blocks bottom-up,
+// alternating between keys and scratch so that the last pass lands in keys
+SIMD_AVX2 inline void sortKeysAvx2(uint64_t* keys, size_t n,
+                                   uint64_t* scratch) {
+  const size_t block = 32;
+  size_t passes = 0;
+  for (size_t w = block; w < n; w *= 2) passes++;
+  uint64_t* src = passes % 2 ? scratch : keys;
+  uint64_t* dst = passes % 2 ? keys : scratch;
+  for (size_t f = 0; f < n; f += block) {
+    size_t m = std::min(block, n - f);
+    if (m > 16) {
+      sortNetworkAvx2<8>(keys + f, m, src + f);
+    } else if (m > 8) {
+      sortNetworkAvx2<4>(keys + f, m, src + f);
+    } else {
+      sortNetworkAvx2<2>(keys + f, m, src + f);
+    }
+  }
+  for (size_t w = block; w < n; w *= 2) {
+    for (size_t f = 0; f < n; f += 2 * w) {
+      size_t m = std::min(f + w, n), r = std::min(f + 2 * w, n);
+      mergeKeysAvx2(src + f, m - f, src + m, r - m, dst + f);
+    }
+    std::swap(src, dst);
+  }
+}
+
+// largest of n > 0 keys, four accumulators of four lanes
+SIMD_AVX2 inline uint64_t maxKeyAvx2(const uint64_t* keys, size_t n) {
+  const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+  __m256i acc[4];
+  for (size_t a = 0; a < 4; a++) acc[a] = bias;  // biased zero
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    for (size_t a = 0; a < 4; a++) {
+      const __m256i* from = reinterpret_cast<const __m256i*>(keys + i + 4 * a);
+      __m256i v = _mm256_xor_si256(_mm256_loadu_si256(from), bias);
+      minMaxAvx2(v, acc[a]);
+    }
+  }
+  minMaxAvx2(acc[0], acc[1]);
+  minMaxAvx2(acc[2], acc[3]);
+  minMaxAvx2(acc[1], acc[3]);
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes),
+                      _mm256_xor_si256(acc[3], bias));
+  uint64_t best = *std::max_element(lanes, lanes + 4);
+  for (; i < n; i++) best = std::max(best, keys[i]);
+  return best;
+}
+
+// lane by lane unsigned max; the masked form avoids the undefined source
+// operand of _mm512_max_epu64, which trips -Wuninitialized on some compilers
+SIMD_AVX512 inline __m512i maxAvx512(__m512i a, __m512i b) {
+  return _mm512_mask_max_epu64(a, 0xFF, a, b);
+}
+
+// largest of n > 0 keys, four accumulators of eight lanes
+SIMD_AVX512 inline uint64_t maxKeyAvx512(const uint64_t* keys, size_t n) {
+  __m512i acc[4];
+  for (size_t a = 0; a < 4; a++) acc[a] = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (size_t a = 0; a < 4; a++) {
+      acc[a] = maxAvx512(acc[a], _mm512_loadu_si512(keys + i + 8 * a));
+    }
+  }
+  for (; i < n; i += 8) {
+    __mmask8 mask = n - i >= 8 ? 0xFF : (1 << (n - i)) - 1;
+    acc[0] = maxAvx512(acc[0], _mm512_maskz_loadu_epi64(mask, keys + i));
+  }
+  acc[0] = maxAvx512(maxAvx512(acc[0], acc[1]), maxAvx512(acc[2], acc[3]));
+  uint64_t lanes[8];
+  _mm512_storeu_si512(lanes, acc[0]);
+  return *std::max_element(lanes, lanes + 8);
+}
+
+// largest of n > 0 keys
+inline uint64_t maxKey(const uint64_t* keys, size_t n) {
+  if (hasAvx512()) return maxKeyAvx512(keys, n);
+  if (hasAvx2()) return maxKeyAvx2(keys, n);
+  return *std::max_element(keys, keys + n);
+}
+
+// sorts n keys, scratch must hold n keys
+inline void sortKeys(uint64_t* keys, size_t n, uint64_t* scratch) {
+  if (hasAvx2()) {
+    sortKeysAvx2(keys, n, scratch);
+  } else {
+    std::sort(keys, keys + n);
+  }
+}
+
+// sorts up to 32 keys in place, with a sorting network when available
+inline void sortSmallKeys(uint64_t* keys, size_t n) {
+  if (hasAvx2()) {
+    if (n > 16) {
+      sortNetworkAvx2<8>(keys, n, keys);
+    } else if (n > 8) {
+      sortNetworkAvx2<4>(keys, n, keys);
+    } else {
+      sortNetworkAvx2<2>(keys, n, keys);
+    }
+    return;
+  }
+  for (size_t i = 1; i < n; i++) {
+    uint64_t key = keys[i];
+    size_t j = i;
+    for (; j > 0 && key < keys[j - 1]; j--) keys[j] = keys[j - 1];
+    keys[j] = key;
+  }
+}
+
+// merges sorted a and b into out, which may not overlap them
+inline void mergeKeys(const uint64_t* a, size_t na, const uint64_t* b,
+                      size_t nb, uint64_t* out) {
+  if (hasAvx2()) {
+    mergeKeysAvx2(a, na, b, nb, out);
+  } else {
+    std::merge(a, a + na, b, b + nb, out);
+  }
+}
+
+#endif  // SRC_SIMD_H_
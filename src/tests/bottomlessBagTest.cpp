@@ -61,7 +61,9 @@ int main(int argc, char **argv) {
            std::shared_ptr<Adventure>(new TeamAdventure(2)),
            std::shared_ptr<Adventure>(new TeamAdventure(3)),
            std::shared_ptr<Adventure>(new TeamAdventure(4)),
-           std::shared_ptr<Adventure>(new TeamAdventure(8))}) {
+           std::shared_ptr<Adventure>(new TeamAdventure(8)),
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(3, TeamAdventure::sharedCouncil()))}) {
     if (argc == 1) {
       // runAndPrintDuration([&adventure]() {
       testCase1(*adventure);
@@ -78,5 +80,19 @@ int main(int argc, char **argv) {
       //});
     }
   }
+  if (argc == 1) {
+    // shamans kept spinning through every row
+    TeamAdventure hotAdventure(3);
+    hotAdventure.setIdlePolicy(idle_policy{100, 10});
+    hotAdventure.setHotPacking(true);
+    testCase1(hotAdventure);
+    testCase2(hotAdventure);
+    testCase3(hotAdventure);
+    // pinned shamans placing the rows themselves
+    TeamAdventure pinnedAdventure(3, queue_backend::locked, pinning::compact);
+    testCase1(pinnedAdventure);
+    testCase2(pinnedAdventure);
+    testCase3(pinnedAdventure);
+  }
   return 0;
 }
@@ -1,5 +1,8 @@
+#include <future>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include "../adventure.h"
@@ -33,6 +36,229 @@ void testCase1(Adventure &adventure) {
   runAndVerify(adventure, t5, r5);
 }
 
+// the best crystal at every position, across chunk and cache line bounds
+void testCase2(Adventure &adventure) {
+  for (size_t n : {1, 2, 9, 64, 65, 333}) {
+    for (size_t best = 0; best < n; ++best) {
+      std::vector<Crystal> crystals(n);
+      for (size_t i = 0; i < n; ++i) crystals[i] = Crystal(i % 7);
+      crystals[best] = Crystal(100);
+      runAndVerify(adventure, crystals, Crystal(100));
+    }
+  }
+}
+
+// shininess with the top bit set, which vectorized kernels must order
+// unsigned
+void testCase3(Adventure &adventure) {
+  std::vector<Crystal> crystals;
+  for (uint64_t i = 0; i < 111; ++i) {
+    crystals.push_back(Crystal(i % 3 ? UINT64_MAX - 2 * i : i << 60));
+  }
+  runAndVerify(adventure, crystals, Crystal(UINT64_MAX - 2));
+}
+
+void testCase4(Adventure &adventure) {
+  for (size_t n : {1, 5, 100, 2000}) {
+    std::vector<Crystal> crystals(n);
+    std::generate(crystals.begin(), crystals.end(),
+                  []() { return std::rand() % 30; });
+    std::vector<size_t> positions(n);
+    for (size_t i = 0; i < n; ++i) positions[i] = i;
+    std::stable_sort(positions.begin(), positions.end(),
+                     [&crystals](size_t a, size_t b) {
+                       return crystals[b] < crystals[a];
+                     });
+    assert_eq_msg(adventure.findBestCrystal(crystals), positions[0],
+                  "Wrong best crystal position");
+    for (size_t k : {size_t(0), size_t(1), size_t(3), n / 2, n, n + 1}) {
+      std::vector<size_t> best = adventure.selectBestCrystals(crystals, k);
+      assert_msg(best == std::vector<size_t>(positions.begin(),
+                                             positions.begin() +
+                                                 std::min(k, n)),
+                 "Wrong best crystals");
+    }
+  }
+}
+
+// chunks from several producers, reduced while they are still submitted
+void testCase5(Adventure &adventure) {
+  std::unique_ptr<Adventure::CrystalStream> empty = adventure.streamCrystals();
+  empty->submit(std::vector<Crystal>());
+  bool thrown = false;
+  try {
+    empty->best();
+  } catch (std::exception &) {
+    thrown = true;
+  }
+  assert_msg(thrown, "Empty crystal stream has no best crystal");
+  std::unique_ptr<Adventure::CrystalStream> stream = adventure.streamCrystals();
+  auto shininess = [](uint64_t p, uint64_t c, uint64_t i) {
+    return (p * 1000 + c * 10 + i) * 7919 % 4099;
+  };
+  uint64_t best = 0;
+  std::vector<std::thread> producers;
+  for (uint64_t p = 0; p < 4; ++p) {
+    for (uint64_t c = 0; c < 50; ++c) {
+      for (uint64_t i = 0; i < c % 7 * 10; ++i) {
+        best = std::max(best, shininess(p, c, i));
+      }
+    }
+    producers.emplace_back([&stream, &shininess, p]() {
+      for (uint64_t c = 0; c < 50; ++c) {
+        std::vector<Crystal> chunk;
+        for (uint64_t i = 0; i < c % 7 * 10; ++i) {
+          chunk.push_back(Crystal(shininess(p, c, i)));
+        }
+        stream->submit(chunk);
+      }
+    });
+  }
+  for (auto &producer : producers) producer.join();
+  assert_msg(stream->best() == Crystal(best), "Wrong streamed crystal");
+}
+
+// a tournament against a scan after every kind of change
+void testCase6(Adventure &adventure) {
+  std::vector<Crystal> crystals(700);
+  std::generate(crystals.begin(), crystals.end(),
+                []() { return std::rand() % 500; });
+  std::vector<bool> present(crystals.size(), true);
+  std::unique_ptr<CrystalTournament> tournament =
+      adventure.holdCrystalTournament(crystals);
+  auto verify = [&]() {
+    size_t best = crystals.size();
+    for (size_t i = 0; i < crystals.size(); ++i) {
+      if (present[i] && (best == crystals.size() ||
+                         crystals[best].getShininess() <
+                             crystals[i].getShininess())) {
+        best = i;
+      }
+    }
+    assert_eq_msg(tournament->bestPosition(), best, "Wrong tournament winner");
+    assert_msg(tournament->best() == crystals[best], "Wrong tournament best");
+  };
+  verify();
+  for (size_t round = 0; round < 300; ++round) {
+    size_t position = std::rand() % crystals.size();
+    switch (round % 4) {
+      case 0:
+        crystals[position] = Crystal(std::rand() % 1000);
+        present[position] = true;
+        tournament->update(position, crystals[position]);
+        break;
+      case 1:
+        present[position] = false;
+        tournament->remove(position);
+        break;
+      case 2:
+        crystals.push_back(Crystal(std::rand() % 600));
+        present.push_back(true);
+        assert_eq_msg(tournament->insert(crystals.back()),
+                      crystals.size() - 1, "Wrong inserted position");
+        break;
+      default: {
+        std::vector<std::pair<size_t, Crystal>> changes;
+        for (size_t i = 0; i < 1 + round % 50 * 10; ++i) {
+          position = std::rand() % crystals.size();
+          crystals[position] = Crystal(std::rand() % 1000);
+          present[position] = true;
+          changes.push_back(std::make_pair(position, crystals[position]));
+        }
+        tournament->update(changes);
+      }
+    }
+    verify();
+  }
+  std::unique_ptr<CrystalTournament> growing =
+      adventure.holdCrystalTournament(std::vector<Crystal>());
+  for (uint64_t i = 0; i < 100; ++i) growing->insert(Crystal(i * 37 % 101));
+  assert_eq_msg(growing->bestPosition(), size_t(30), "Wrong grown winner");
+  // a position past the last crystal is no update, on a full tree or not
+  for (size_t n : {4, 5}) {
+    std::unique_ptr<CrystalTournament> small =
+        adventure.holdCrystalTournament(std::vector<Crystal>(n, Crystal(1)));
+    bool thrown = false;
+    try {
+      small->update(n, Crystal(9));
+    } catch (std::out_of_range &) {
+      thrown = true;
+    }
+    assert_msg(thrown, "Update past the last crystal accepted");
+    assert_msg(small->best() == Crystal(1), "Update past the last crystal won");
+  }
+}
+
+// every combination of statistics against separate scans
+void testCase7(Adventure &adventure) {
+  for (size_t n : {1, 7, 64, 1000}) {
+    std::vector<Crystal> crystals(n);
+    std::generate(crystals.begin(), crystals.end(),
+                  []() { return std::rand() % 90; });
+    uint64_t max = 0, min = UINT64_MAX;
+    size_t maxPosition = 0, maxCount = 0;
+    std::vector<size_t> histogram(4);
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t shininess = crystals[i].getShininess();
+      if (shininess > max || i == 0) maxPosition = i;
+      max = std::max(max, shininess);
+      min = std::min(min, shininess);
+      histogram[std::min<uint64_t>(shininess / 25, 3)]++;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      maxCount += crystals[i].getShininess() == max;
+    }
+    for (unsigned statistics = 1; statistics < 32; ++statistics) {
+      Adventure::CrystalSurvey survey =
+          adventure.surveyCrystals(crystals, statistics, 4, 25);
+      if (statistics & Adventure::kMaxCrystal) {
+        assert_msg(survey.maxCrystal == Crystal(max), "Wrong max crystal");
+      }
+      if (statistics & Adventure::kMinCrystal) {
+        assert_msg(survey.minCrystal == Crystal(min), "Wrong min crystal");
+      }
+      if (statistics & Adventure::kMaxPosition) {
+        assert_eq_msg(survey.maxPosition, maxPosition, "Wrong max position");
+      }
+      if (statistics & Adventure::kMaxCount) {
+        assert_eq_msg(survey.maxCount, maxCount, "Wrong max count");
+      }
+      if (statistics & Adventure::kHistogram) {
+        assert_msg(survey.histogram == histogram, "Wrong histogram");
+      }
+    }
+  }
+  // a histogram without buckets, or of buckets of width 0
+  std::vector<Crystal> crystals(10, Crystal(3));
+  for (size_t buckets : {0, 4}) {
+    bool thrown = false;
+    try {
+      adventure.surveyCrystals(crystals, Adventure::kHistogram, buckets,
+                               buckets == 0 ? 25 : 0);
+    } catch (std::invalid_argument &) {
+      thrown = true;
+    }
+    assert_msg(thrown, "Histogram without buckets accepted");
+  }
+}
+
+// many publishers racing on one record
+void testCase8() {
+  BestCrystalRecord record;
+  assert_msg(record.best() == Crystal(0), "Empty record is not zero");
+  std::vector<std::thread> publishers;
+  for (uint64_t p = 0; p < 4; ++p) {
+    publishers.emplace_back([&record, p]() {
+      BestCrystalRecord::Publisher publisher(&record);
+      for (uint64_t i = 0; i < 100000; ++i) {
+        publisher.offer(Crystal((i * 4 + p) * 7919 % 400009));
+      }
+    });
+  }
+  for (auto &publisher : publishers) publisher.join();
+  assert_msg(record.best() == Crystal(400008), "Wrong recorded crystal");
+}
+
 int main(int argc, char **argv) {
   for (std::shared_ptr<Adventure> adventure :
        std::vector<std::shared_ptr<Adventure> >{
@@ -41,12 +267,31 @@ int main(int argc, char **argv) {
            std::shared_ptr<Adventure>(new TeamAdventure(2)),
            std::shared_ptr<Adventure>(new TeamAdventure(3)),
            std::shared_ptr<Adventure>(new TeamAdventure(4)),
-           std::shared_ptr<Adventure>(new TeamAdventure(8))}) {
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(4, queue_backend::lock_free)),
+           std::shared_ptr<Adventure>(new TeamAdventure(8)),
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(3, TeamAdventure::sharedCouncil()))}) {
     if (argc == 1) {
       // runAndPrintDuration([&adventure]() {
       testCase1(*adventure);
+      testCase2(*adventure);
+      testCase3(*adventure);
+      testCase4(*adventure);
+      testCase5(*adventure);
+      testCase6(*adventure);
+      testCase7(*adventure);
+      adventure->setCrystalComparison(Adventure::CrystalComparison::kKeys);
+      testCase1(*adventure);
+      testCase2(*adventure);
+      testCase3(*adventure);
+      testCase4(*adventure);
+      testCase5(*adventure);
+      testCase7(*adventure);
       // });
     } else {
+      // the vectorized key path is what these runs measure
+      adventure->setCrystalComparison(Adventure::CrystalComparison::kKeys);
       std::vector<Crystal> t2(2575757);
       std::generate(t2.begin(), t2.end(), std::rand);
       Crystal r2 = *std::max_element(t2.begin(), t2.end());
@@ -64,6 +309,28 @@ int main(int argc, char **argv) {
       // });
     }
   }
+  if (argc == 1) {
+    testCase8();
+    // a tournament held from a task of a council with a single shaman
+    std::shared_ptr<ThreadPool> single = std::make_shared<ThreadPool>(1);
+    TeamAdventure guest(2, single);
+    single->enqueue([&guest] { testCase6(guest); }).get();
+    // an adventure of one shaman queues nothing, streams and tournaments
+    // included, so it finishes even while its council is held up
+    std::promise<void> hold;
+    std::shared_future<void> held = hold.get_future().share();
+    std::shared_ptr<ThreadPool> council = std::make_shared<ThreadPool>(2);
+    std::vector<std::future<void>> holders;
+    for (size_t w = 0; w < council->size(); w++) {
+      holders.push_back(council->enqueue([held] { held.wait(); }));
+    }
+    TeamAdventure alone(1, council);
+    testCase1(alone);
+    testCase5(alone);
+    testCase6(alone);
+    hold.set_value();
+    for (auto &holder : holders) holder.get();
+  }
 
   return 0;
 }
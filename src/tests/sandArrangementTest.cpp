@@ -1,3 +1,13 @@
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "../adventure.h"
@@ -29,6 +39,183 @@ void testCase1(Adventure &adventure) {
   runAndVerify(adventure, t3, r3);
 }
 
+void testCase2(Adventure &adventure) {
+  for (size_t n : {0, 1, 2, 17, 1000}) {
+    std::vector<GrainOfSand> ascending, descending, equal, random, nearly;
+    for (size_t i = 0; i < n; ++i) {
+      ascending.push_back(GrainOfSand(i));
+      descending.push_back(GrainOfSand(n - i));
+      equal.push_back(GrainOfSand(7));
+      random.push_back(GrainOfSand(std::rand() % 100));
+      nearly.push_back(GrainOfSand(i < n / 2 ? i : std::rand() % n));
+    }
+    std::reverse(nearly.begin() + n / 8, nearly.begin() + n / 4);
+    for (std::vector<GrainOfSand> t :
+         {ascending, descending, equal, random, nearly}) {
+      std::vector<GrainOfSand> r = t;
+      std::sort(r.begin(), r.end());
+      runAndVerify(adventure, t, r);
+    }
+  }
+}
+
+// sizes with the top bit set, which vectorized kernels must order unsigned
+void testCase3(Adventure &adventure) {
+  std::vector<GrainOfSand> t, r;
+  for (uint64_t i = 0; i < 333; ++i) {
+    t.push_back(GrainOfSand(i % 2 ? UINT64_MAX - i : i << 62));
+  }
+  r = t;
+  std::sort(r.begin(), r.end());
+  runAndVerify(adventure, t, r);
+}
+
+void testCase5(Adventure &adventure) {
+  for (size_t n : {1, 2, 50, 3333}) {
+    std::vector<GrainOfSand> t(n);
+    std::generate(t.begin(), t.end(), []() { return std::rand() % 500; });
+    std::vector<GrainOfSand> r = t;
+    std::sort(r.begin(), r.end());
+    for (size_t k : {size_t(0), size_t(1), n / 3, n - 1, n}) {
+      std::vector<GrainOfSand> partial = t;
+      adventure.arrangeSandPartially(partial, k);
+      assert_msg(std::equal(r.begin(), r.begin() + k, partial.begin()),
+                 "Wrong partial sand arrangement");
+      std::vector<GrainOfSand> smallest = adventure.selectSmallestGrains(t, k);
+      assert_msg(std::vector<GrainOfSand>(r.begin(), r.begin() + k) == smallest,
+                 "Wrong smallest grains");
+      if (k < n) {
+        std::vector<GrainOfSand> ranked = t;
+        GrainOfSand grain = adventure.findGrainOfRank(ranked, k);
+        assert_msg(grain == r[k] && ranked[k] == r[k], "Wrong grain of rank");
+        for (size_t i = 0; i < n; ++i) {
+          assert_msg(i < k ? !(r[k] < ranked[i]) : !(ranked[i] < r[k]),
+                     "Grains on the wrong side of rank");
+        }
+      }
+    }
+  }
+}
+
+template <typename Index>
+void verifyOrder(Adventure &adventure, std::vector<GrainOfSand> t) {
+  std::vector<GrainOfSand> r = t;
+  std::sort(r.begin(), r.end());
+  std::vector<Index> order;
+  adventure.arrangeSandOrder(t, order, false);
+  assert_eq_msg(order.size(), t.size(), "Wrong sand order size");
+  for (size_t i = 0; i < order.size(); ++i) {
+    assert_msg(t[order[i]] == r[i], "Wrong sand order");
+    assert_msg(i == 0 || !(t[order[i]] == t[order[i - 1]]) ||
+                   order[i - 1] < order[i],
+               "Unstable sand order");
+  }
+  adventure.arrangeSandOrder(t, order, true);
+  assert_msg(t == r, "Wrong sand order arrangement");
+}
+
+void testCase6(Adventure &adventure) {
+  for (size_t n : {0, 1, 7, 2000}) {
+    std::vector<GrainOfSand> t(n);
+    std::generate(t.begin(), t.end(), []() { return std::rand() % 50; });
+    verifyOrder<uint32_t>(adventure, t);
+    verifyOrder<uint64_t>(adventure, t);
+  }
+}
+
+void testCase7(Adventure &adventure) {
+  std::vector<std::vector<GrainOfSand>> batches, results;
+  std::vector<GrainOfSand> grains, result;
+  std::vector<size_t> offsets = {0};
+  for (size_t i = 0; i < 3000; ++i) {
+    size_t n = i % 1000 == 999 ? 5000 + i : std::rand() % 8;
+    std::vector<GrainOfSand> t(n);
+    std::generate(t.begin(), t.end(), std::rand);
+    batches.push_back(t);
+    grains.insert(grains.end(), t.begin(), t.end());
+    offsets.push_back(grains.size());
+    std::sort(t.begin(), t.end());
+    results.push_back(t);
+    result.insert(result.end(), t.begin(), t.end());
+  }
+  adventure.arrangeSandBatch(batches);
+  assert_msg(batches == results, "Wrong sand batch arrangement");
+  adventure.arrangeSandSegments(grains, offsets);
+  assert_msg(grains == result, "Wrong sand segments arrangement");
+  // offsets not starting at 0, decreasing, or past the last grain
+  const size_t n = grains.size();
+  for (std::vector<size_t> bad : std::vector<std::vector<size_t>>{
+           {1, n}, {0, 5, 4, n}, {0, n + 1}}) {
+    bool thrown = false;
+    try {
+      adventure.arrangeSandSegments(grains, bad);
+    } catch (std::invalid_argument &) {
+      thrown = true;
+    }
+    assert_msg(thrown, "Offsets that are no segments accepted");
+  }
+  assert_msg(grains == result, "Sand changed by rejected segments");
+}
+
+// sorts a file of sizes in chunks smaller than the file, in a temporary
+// directory
+void testCase4(TeamAdventure &adventure) {
+  const char *tmp = std::getenv("TMPDIR");
+  std::string dir = std::string(tmp != nullptr ? tmp : "/tmp") +
+                    "/sandArrangementTest.XXXXXX";
+  assert_msg(mkdtemp(&dir[0]) != nullptr, "Cannot create a directory");
+  const std::string input = dir + "/in";
+  const std::string output = dir + "/out";
+  for (size_t n : {0, 1, 999, 10007}) {
+    std::vector<uint64_t> sizes(n);
+    std::generate(sizes.begin(), sizes.end(), std::rand);
+    std::FILE *file = std::fopen(input.c_str(), "wb");
+    std::fwrite(sizes.data(), sizeof(uint64_t), n, file);
+    std::fclose(file);
+
+    adventure.arrangeSandFile(input, output, 1000);
+
+    std::vector<uint64_t> result(n + 1);
+    file = std::fopen(output.c_str(), "rb");
+    size_t read = std::fread(result.data(), sizeof(uint64_t), n + 1, file);
+    std::fclose(file);
+    result.resize(read);
+    std::sort(sizes.begin(), sizes.end());
+    assert_msg(result == sizes, "Wrong sand file arrangement");
+  }
+  std::remove(output.c_str());
+  // an output that cannot be opened fails after the runs are written, which
+  // must not be left behind
+  assert_msg(mkdir(output.c_str(), 0700) == 0, "Cannot create a directory");
+  bool thrown = false;
+  try {
+    adventure.arrangeSandFile(input, output, 1000);
+  } catch (std::runtime_error &) {
+    thrown = true;
+  }
+  assert_msg(thrown, "Unwritable sand output accepted");
+  std::FILE *run = std::fopen((output + ".run0").c_str(), "rb");
+  assert_msg(run == nullptr, "Run file left behind");
+  rmdir(output.c_str());
+  // chunks of no grains would write nothing at all
+  thrown = false;
+  try {
+    adventure.arrangeSandFile(input, output, 0);
+  } catch (std::invalid_argument &) {
+    thrown = true;
+  }
+  assert_msg(thrown, "Empty sand chunks accepted");
+  std::remove(output.c_str());
+  std::remove(input.c_str());
+  rmdir(dir.c_str());
+}
+
+const std::vector<TeamAdventure::SortMode> kSortModes = {
+    TeamAdventure::SortMode::kInplaceMerge,
+    TeamAdventure::SortMode::kPingPong,
+    TeamAdventure::SortMode::kAdaptive,
+    TeamAdventure::SortMode::kInPlace};
+
 int main(int argc, char **argv) {
   for (std::shared_ptr<Adventure> adventure :
        std::vector<std::shared_ptr<Adventure> >{
@@ -37,10 +224,17 @@ int main(int argc, char **argv) {
            std::shared_ptr<Adventure>(new TeamAdventure(2)),
            std::shared_ptr<Adventure>(new TeamAdventure(3)),
            std::shared_ptr<Adventure>(new TeamAdventure(4)),
-           std::shared_ptr<Adventure>(new TeamAdventure(8))}) {
+           std::shared_ptr<Adventure>(new TeamAdventure(8)),
+           std::shared_ptr<Adventure>(
+               new TeamAdventure(3, TeamAdventure::sharedCouncil()))}) {
     if (argc == 1) {
       // runAndPrintDuration([&adventure]() {
       testCase1(*adventure);
+      testCase2(*adventure);
+      testCase3(*adventure);
+      testCase5(*adventure);
+      testCase6(*adventure);
+      testCase7(*adventure);
       //});
     } else {
       std::vector<GrainOfSand> t2(50000);
@@ -63,5 +257,57 @@ int main(int argc, char **argv) {
       // });
     }
   }
+  if (argc == 1) {
+    for (TeamAdventure::SortMode mode : kSortModes) {
+      for (uint64_t shamans : {1, 3, 8}) {
+        TeamAdventure adventure(shamans);
+        adventure.setSortMode(mode);
+        testCase1(adventure);
+        testCase2(adventure);
+        testCase3(adventure);
+        testCase4(adventure);
+      }
+      // pinned shamans, whose stealing crosses nodes
+      TeamAdventure pinned(3, queue_backend::locked, pinning::scatter);
+      pinned.setSortMode(mode);
+      testCase1(pinned);
+      testCase2(pinned);
+      testCase3(pinned);
+    }
+    // two adventures arranging sand at once on one council
+    std::shared_ptr<ThreadPool> council = std::make_shared<ThreadPool>(4);
+    TeamAdventure first(3, council), second(8, council);
+    second.setSortMode(TeamAdventure::SortMode::kAdaptive);
+    std::thread other([&second] {
+      testCase2(second);
+      testCase3(second);
+    });
+    testCase2(first);
+    testCase3(first);
+    other.join();
+    // an adventure of one shaman queues nothing, so it finishes even while
+    // every shaman of its council is held up
+    std::promise<void> hold;
+    std::shared_future<void> held = hold.get_future().share();
+    std::vector<std::future<void>> holders;
+    for (size_t w = 0; w < council->size(); w++) {
+      holders.push_back(council->enqueue([held] { held.wait(); }));
+    }
+    for (TeamAdventure::SortMode mode : kSortModes) {
+      TeamAdventure alone(1, council);
+      alone.setSortMode(mode);
+      testCase2(alone);
+      testCase3(alone);
+    }
+    hold.set_value();
+    for (auto &holder : holders) holder.get();
+    bool thrown = false;
+    try {
+      TeamAdventure orphan(3, std::shared_ptr<ThreadPool>());
+    } catch (std::invalid_argument &) {
+      thrown = true;
+    }
+    assert_msg(thrown, "Adventure joined a missing council");
+  }
   return 0;
 }
@@ -0,0 +1,483 @@
+#include <time.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../third_party/threadpool/threadpool.h"
+#include "../utils.h"
+
+// counts heap allocations of the whole test
+std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = std::malloc(size == 0 ? 1 : size);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+// GCC 12 mistakes the free below, once inlined, for freeing memory from the
+// built-in operator new
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void *p) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+
+// tasks enqueued from outside the pool
+void testCase1(ThreadPool &pool) {
+  std::vector<std::future<uint64_t> > results;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    results.push_back(pool.enqueue([](uint64_t x) { return x * x; }, i));
+  }
+  uint64_t sum = 0;
+  for (auto &result : results) sum += result.get();
+  assert_eq_msg(sum, 332833500, "Wrong sum of squares");
+}
+
+// help function for testCase2, spawns two tasks per level from workers
+void spawn(ThreadPool *pool, size_t depth, Latch *latch) {
+  if (depth == 0) {
+    latch->count_down();
+    return;
+  }
+  pool->enqueue(spawn, pool, depth - 1, latch);
+  pool->enqueue(spawn, pool, depth - 1, latch);
+}
+
+// fine-grained recursive spawning, every task landing in a worker's deque
+void testCase2(ThreadPool &pool, size_t depth) {
+  Latch latch(size_t(1) << depth);
+  pool.enqueue(spawn, &pool, depth, &latch);
+  latch.wait();
+}
+
+// one task spawning far more tasks than a deque initially holds
+void testCase3(ThreadPool &pool) {
+  std::atomic<uint64_t> sum(0);
+  Latch latch(5000);
+  pool.enqueue([&pool, &sum, &latch]() {
+        for (uint64_t i = 0; i < 5000; ++i) {
+          pool.enqueue([&sum, &latch, i]() {
+            sum += i;
+            latch.count_down();
+          });
+        }
+      })
+      .wait();
+  latch.wait();
+  assert_eq_msg(sum, 12497500, "Wrong sum of spawned tasks");
+}
+
+// help function for testCase4, waits on a child from inside a worker
+uint64_t fibonacci(ThreadPool *pool, uint64_t n) {
+  if (n < 2) return n;
+  auto x = pool->enqueue(fibonacci, pool, n - 1);
+  uint64_t y = fibonacci(pool, n - 2);
+  pool->wait(x);
+  return x.get() + y;
+}
+
+// recursion deeper than the pool is wide, which deadlocks if waiting
+// workers do not run queued tasks
+void testCase4(ThreadPool &pool) {
+  auto x = pool.enqueue(fibonacci, &pool, 20);
+  pool.wait(x);
+  assert_eq_msg(x.get(), 6765, "Wrong fibonacci number");
+}
+
+// every index visited exactly once, for every grain and range
+void testCase5(ThreadPool &pool) {
+  for (size_t n : {0, 1, 7, 1000}) {
+    for (size_t grain : {0, 1, 3, 64, 5000}) {
+      std::vector<std::atomic<int> > visits(n + 5);
+      for (auto &visit : visits) visit = 0;
+      pool.parallel_for(5, n + 5, grain, [&visits](size_t f, size_t r) {
+        for (size_t i = f; i < r; ++i) visits[i]++;
+      });
+      for (size_t i = 0; i < n + 5; ++i) {
+        assert_eq_msg(visits[i], i >= 5, "Wrong parallel_for visits");
+      }
+      uint64_t sum = pool.parallel_reduce(
+          0, n, grain, uint64_t(0),
+          [](size_t f, size_t r) {
+            uint64_t partial = 0;
+            for (size_t i = f; i < r; ++i) partial += i;
+            return partial;
+          },
+          [](uint64_t a, uint64_t b) { return a + b; });
+      assert_eq_msg(sum, n * (n - 1) / 2, "Wrong parallel_reduce sum");
+    }
+  }
+}
+
+// help function for testCase6, a parallel_for nested in every chunk
+void nestedSum(ThreadPool *pool, std::atomic<uint64_t> *sum) {
+  pool->parallel_for(0, 16, 1, [pool, sum](size_t f, size_t) {
+    pool->parallel_for(0, 100, 7, [sum, f](size_t g, size_t r) {
+      for (size_t i = g; i < r; ++i) *sum += f * 100 + i;
+    });
+  });
+}
+
+// nested loops started from workers, which must help instead of blocking
+void testCase6(ThreadPool &pool) {
+  std::atomic<uint64_t> sum(0);
+  pool.enqueue(nestedSum, &pool, &sum).get();
+  assert_eq_msg(sum, 1599 * 1600 / 2, "Wrong nested parallel_for sum");
+}
+
+// help function for testCase7
+void addTo(std::atomic<uint64_t> *sum, uint64_t x) { *sum += x; }
+
+// help function for testCase7, posts from inside a worker
+void postMany(ThreadPool *pool, std::atomic<uint64_t> *sum) {
+  TaskHandle handles[300];
+  for (uint64_t i = 0; i < 300; ++i) handles[i] = pool->post(addTo, sum, i);
+  for (auto &handle : handles) pool->wait(handle);
+}
+
+// posted tasks allocate nothing once their slots are warm; every worker
+// fetches slabs the first time it hosts postMany, so the test waits for a
+// streak of rounds without allocations
+void testCase7(ThreadPool &pool) {
+  std::atomic<uint64_t> sum(0);
+  TaskHandle handles[300];
+  int rounds = 0, streak = 0;
+  for (; rounds < 500 && streak < 10; ++rounds) {
+    uint64_t before = allocations;
+    for (uint64_t i = 0; i < 300; ++i) handles[i] = pool.post(addTo, &sum, i);
+    for (auto &handle : handles) pool.wait(handle);
+    pool.wait(pool.post(postMany, &pool, &sum));
+    streak = allocations == before ? streak + 1 : 0;
+  }
+  assert_msg(streak == 10, "Posted tasks keep allocating");
+  assert_eq_msg(sum, rounds * 299 * 300, "Wrong sum of posted tasks");
+}
+
+// help function for testCase8
+void submitFromOutside(ThreadPool *pool, std::atomic<uint64_t> *sum,
+                       uint64_t n) {
+  TaskHandle handles[64];
+  for (uint64_t i = 0; i < n; ++i) {
+    pool->wait(handles[i % 64]);
+    handles[i % 64] = pool->post(addTo, sum, i);
+  }
+  for (auto &handle : handles) pool->wait(handle);
+}
+
+// several threads outside the pool submitting at once
+void testCase8(ThreadPool &pool, uint64_t n) {
+  std::atomic<uint64_t> sum(0);
+  std::vector<std::thread> submitters;
+  for (int t = 0; t < 4; ++t) {
+    submitters.emplace_back(submitFromOutside, &pool, &sum, n);
+  }
+  for (auto &submitter : submitters) submitter.join();
+  assert_eq_msg(sum, 4 * n * (n - 1) / 2, "Wrong sum of outside tasks");
+}
+
+// spinning idle workers and hot sections give the same results
+void testCase9(ThreadPool &pool) {
+  pool.set_idle_policy(idle_policy{200, 20});
+  testCase2(pool, 8);
+  {
+    ThreadPool::hot_section hot(pool);
+    for (int round = 0; round < 20; ++round) testCase5(pool);
+  }
+  pool.set_idle_policy(idle_policy{0, 0});
+  testCase4(pool);
+}
+
+// static blocks cover the range once and stay on their worker, also when
+// posted from inside the pool
+void testCase10(ThreadPool &pool) {
+  const size_t n = 1000;
+  std::vector<std::atomic<uint64_t> > hits(n);
+  for (auto &hit : hits) hit = 0;
+  std::vector<std::thread::id> first(n), second(n);
+  pool.parallel_for_static(0, n, 8, [&](size_t f, size_t r) {
+    assert_msg(f % 8 == 0, "Static block not aligned to the grain");
+    for (size_t i = f; i < r; ++i) {
+      hits[i]++;
+      first[i] = std::this_thread::get_id();
+    }
+  });
+  pool.wait(pool.post([&] {
+    pool.parallel_for_static(0, n, 8, [&](size_t f, size_t r) {
+      for (size_t i = f; i < r; ++i) {
+        hits[i]++;
+        second[i] = std::this_thread::get_id();
+      }
+    });
+  }));
+  for (size_t i = 0; i < n; ++i) {
+    assert_eq_msg(hits[i], 2, "Index not covered once per call");
+    assert_msg(first[i] == second[i], "Static block moved to another worker");
+  }
+  std::atomic<uint64_t> sum(0);
+  std::vector<TaskHandle> handles;
+  for (uint64_t i = 0; i < 100; ++i) {
+    handles.push_back(pool.post_to(i % pool.size(), addTo, &sum, i));
+  }
+  for (auto &handle : handles) pool.wait(handle);
+  assert_eq_msg(sum, 99 * 100 / 2, "Wrong sum of tasks posted to workers");
+}
+
+// cpu lists and placement of pinned workers
+void testCase11() {
+  std::vector<int> cpus = CpuTopology::parse_cpu_list("0-3,8,10-11\n");
+  assert_msg(cpus == std::vector<int>({0, 1, 2, 3, 8, 10, 11}),
+             "Wrong parsed cpu list");
+  assert_msg(CpuTopology::parse_cpu_list("").empty(), "Empty cpu list");
+  CpuTopology topology = CpuTopology::discover();
+  assert_msg(topology.nodes() > 0, "No NUMA node found");
+  for (pinning mode : {pinning::compact, pinning::scatter}) {
+    ThreadPool pool(4, queue_backend::locked, 16, mode);
+    for (size_t i = 0; i < pool.size(); ++i) {
+      assert_msg(pool.node_of(i) < topology.nodes(), "Worker off every node");
+    }
+    testCase2(pool, 10);
+    testCase5(pool);
+    testCase10(pool);
+  }
+}
+
+// help function for testCase12, a task counting how many run at once
+void busyTask(std::atomic<uint64_t> *running, std::atomic<uint64_t> *most) {
+  uint64_t now = ++*running;
+  uint64_t seen = *most;
+  while (now > seen && !most->compare_exchange_weak(seen, now)) {
+  }
+  std::this_thread::sleep_for(std::chrono::microseconds(100));
+  --*running;
+}
+
+// shrinking and growing the active workers at runtime
+void testCase12() {
+  ThreadPool pool(4);
+  for (size_t threads : {2, 1, 4, 3}) {
+    pool.set_active_workers(threads);
+    assert_eq_msg(pool.active_workers(), threads, "Wrong active workers");
+    // lets workers that were already looking for a task park
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::atomic<uint64_t> running(0), most(0);
+    std::vector<TaskHandle> handles;
+    for (int i = 0; i < 200; ++i) {
+      handles.push_back(pool.post(busyTask, &running, &most));
+    }
+    for (auto &handle : handles) pool.wait(handle);
+    assert_msg(most <= threads, "More tasks running than active workers");
+    testCase2(pool, 10);
+    testCase4(pool);
+    testCase5(pool);
+    testCase10(pool);
+  }
+  pool.set_active_workers(0);
+  assert_eq_msg(pool.active_workers(), 1, "No active worker left");
+  pool.set_active_workers(100);
+  assert_eq_msg(pool.active_workers(), 4, "More active workers than threads");
+  // tasks posted to parked workers still run when the pool is destroyed
+  std::atomic<uint64_t> delivered(0);
+  {
+    ThreadPool parking(4);
+    parking.set_active_workers(1);
+    for (size_t i = 0; i < 40; ++i) {
+      parking.post_to(1 + i % 3, [&delivered] {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        delivered++;
+      });
+    }
+  }
+  assert_eq_msg(delivered, 40, "Posted task lost at destruction");
+}
+
+// help function for testCase13, sums [f, r) in nested groups
+void groupSum(ThreadPool *pool, TaskGroup *group, std::atomic<uint64_t> *sum,
+              uint64_t f, uint64_t r) {
+  if (r - f <= 16) {
+    for (uint64_t i = f; i < r; ++i) *sum += i;
+    return;
+  }
+  TaskGroup children(*pool, *group);
+  uint64_t m = (f + r) / 2;
+  children.spawn([=, &children] { groupSum(pool, &children, sum, f, m); });
+  groupSum(pool, &children, sum, m, r);
+  children.wait();
+}
+
+// task groups: waiting, early exit, first exception, dropped subtrees
+void testCase13(ThreadPool &pool) {
+  std::atomic<uint64_t> sum(0);
+  {
+    TaskGroup group(pool);
+    group.spawn([&] { groupSum(&pool, &group, &sum, 0, 10000); });
+    group.wait();
+  }
+  assert_eq_msg(sum, 10000 * 9999 / 2, "Wrong sum of task groups");
+
+  // the first chunk holding the target cancels the search
+  std::vector<uint64_t> values(100000);
+  for (uint64_t i = 0; i < values.size(); ++i) values[i] = i % 1000;
+  std::atomic<uint64_t> found(values.size()), scanned(0);
+  TaskGroup search(pool);
+  CancellationToken token = search.token();
+  for (uint64_t f = 0; f < values.size(); f += 1000) {
+    search.spawn([&, f] {
+      for (uint64_t i = f; i < f + 1000 && !token.cancelled(); ++i) {
+        scanned++;
+        if (values[i] == 999) {
+          found = i;
+          search.cancel();
+        }
+      }
+    });
+  }
+  search.wait();
+  assert_msg(search.cancelled(), "Search not cancelled");
+  assert_eq_msg(found % 1000, 999, "Wrong position found");
+  assert_msg(scanned < values.size(), "Cancelled search scanned everything");
+
+  TaskGroup failing(pool);
+  std::atomic<uint64_t> ran(0);
+  for (int i = 0; i < 50; ++i) {
+    failing.spawn([&ran, i] {
+      ran++;
+      if (i == 7) throw std::runtime_error("seventh task");
+    });
+  }
+  bool thrown = false;
+  try {
+    failing.wait();
+  } catch (const std::runtime_error &error) {
+    thrown = std::string(error.what()) == "seventh task";
+  }
+  assert_msg(thrown, "Exception of a task not rethrown");
+  assert_msg(failing.cancelled(), "Failing group not cancelled");
+  failing.wait();
+
+  // a task cancelling its group drops everything it spawns afterwards
+  std::atomic<uint64_t> dropped(0);
+  TaskGroup outer(pool);
+  outer.spawn([&] {
+    TaskGroup inner(pool, outer);
+    outer.cancel();
+    for (int i = 0; i < 100; ++i) inner.spawn([&dropped] { dropped++; });
+    outer.spawn([&dropped] { dropped++; });
+  });
+  outer.wait();
+  assert_eq_msg(dropped, 0, "Task of a cancelled group ran");
+
+  // unwaited tasks are cancelled and waited for by the destructor
+  {
+    TaskGroup unwaited(pool);
+    for (int i = 0; i < 100; ++i) {
+      unwaited.spawn([] { throw std::runtime_error("never collected"); });
+    }
+  }
+}
+
+// cpu time of the calling thread in milliseconds
+double threadCpuTime() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+// a thread outside the pool sleeps while it waits for a posted task
+void testCase14(ThreadPool &pool) {
+  double before = threadCpuTime();
+  TaskHandle handle = pool.post(
+      [] { std::this_thread::sleep_for(std::chrono::milliseconds(100)); });
+  pool.wait(handle);
+  assert_msg(handle.done(), "Posted task not done after wait");
+  assert_msg(threadCpuTime() - before < 50, "Waiting outside the pool spins");
+}
+
+// ring capacities other than powers of two from 2 are rejected
+void testCase15() {
+  for (size_t capacity : {0, 1, 3, 1000}) {
+    bool thrown = false;
+    try {
+      ThreadPool pool(2, queue_backend::lock_free, capacity);
+    } catch (std::invalid_argument &) {
+      thrown = true;
+    }
+    assert_msg(thrown, "Ring capacity not a power of two accepted");
+  }
+  ThreadPool pool(2, queue_backend::lock_free, 2);
+  std::vector<std::future<size_t>> results;
+  for (size_t i = 0; i < 100; i++) {
+    results.push_back(pool.enqueue([i] { return i; }));
+  }
+  for (size_t i = 0; i < 100; i++) {
+    assert_msg(results[i].get() == i, "Wrong result with a ring of two");
+  }
+}
+
+// parallel loops in a task of a stopping pool throw instead of leaving
+// helpers behind that refer to the finished loop
+void testCase16() {
+  for (bool blocks : {false, true}) {
+    std::future<void> late;
+    {
+      ThreadPool pool(2);
+      late = pool.enqueue([&pool, blocks] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        if (blocks) {
+          pool.parallel_for_static(0, 100, 1, [](size_t, size_t) {});
+        } else {
+          pool.parallel_for(0, 100, 1, [](size_t, size_t) {});
+        }
+      });
+    }
+    bool thrown = false;
+    try {
+      late.get();
+    } catch (std::runtime_error &) {
+      thrown = true;
+    }
+    assert_msg(thrown, "Parallel loop on a stopped pool accepted");
+  }
+}
+
+int main(int argc, char **argv) {
+  for (size_t threads : {1, 2, 3, 4, 8}) {
+    // a tiny ring makes the lock-free backend spill to its locked list
+    for (auto backend : {queue_backend::locked, queue_backend::lock_free}) {
+      std::unique_ptr<ThreadPool> pool(new ThreadPool(threads, backend, 16));
+      if (argc == 1) {
+        testCase1(*pool);
+        testCase2(*pool, 10);
+        testCase3(*pool);
+        testCase4(*pool);
+        testCase5(*pool);
+        testCase6(*pool);
+        testCase7(*pool);
+        testCase8(*pool, 5000);
+        testCase9(*pool);
+        testCase10(*pool);
+        testCase13(*pool);
+        testCase14(*pool);
+      } else {
+        testCase2(*pool, 16);
+        testCase8(*pool, 20000);
+      }
+    }
+  }
+  if (argc == 1) {
+    testCase11();
+    testCase12();
+    testCase15();
+    testCase16();
+  }
+  return 0;
+}
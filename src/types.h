@@ -1,6 +1,7 @@
 #ifndef SRC_TYPES_H_
 #define SRC_TYPES_H_
 
+#include <type_traits>
 #include <vector>
 
 #include "./utils.h"
@@ -34,6 +35,21 @@ class GrainOfSand {
 
   GrainOfSand(uint64_t sizeArg) : size(sizeArg) {}  //  NOLINT
 
+  uint64_t getSize() const { return this->size; }
+
+  // a grain is laid out exactly as its size, so a run of grains can be
+  // sorted as a run of plain keys
+  static uint64_t* sizes(GrainOfSand* grains) {
+    static_assert(sizeof(GrainOfSand) == sizeof(uint64_t) &&
+                      std::is_standard_layout<GrainOfSand>::value,
+                  "GrainOfSand must hold nothing but its size");
+    return reinterpret_cast<uint64_t*>(grains);
+  }
+
+  static bool bySize(GrainOfSand const& a, GrainOfSand const& b) {
+    return a.size < b.size;
+  }
+
   bool operator<(GrainOfSand const& other) const {
     burden(this->size, other.size);
     return this->size < other.size;
@@ -58,6 +74,17 @@ class Crystal {
 
   Crystal(uint64_t shininessArg) : shininess(shininessArg) {}  // NOLINT
 
+  uint64_t getShininess() const { return this->shininess; }
+
+  // opt-in key view: a crystal is laid out exactly as its shininess, so a
+  // run of crystals can be reduced as a run of plain keys
+  static const uint64_t* shininesses(const Crystal* crystals) {
+    static_assert(sizeof(Crystal) == sizeof(uint64_t) &&
+                      std::is_standard_layout<Crystal>::value,
+                  "Crystal must hold nothing but its shininess");
+    return reinterpret_cast<const uint64_t*>(crystals);
+  }
+
   bool operator<(Crystal const& other) const {
     burden(this->shininess, other.shininess);
     return this->shininess < other.shininess;
@@ -1,55 +1,955 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <fstream>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// one-shot countdown of a fixed number of events; wait blocks until all of
+// them happened. Only the last event takes the lock, and it is released
+// before wait returns, so the latch may be destroyed right after wait.
+class Latch {
+ public:
+  explicit Latch(size_t count) : count(count), done(count == 0) {}
+  void count_down() {
+    if (count.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    std::unique_lock<std::mutex> lock(mutex);
+    done = true;
+    condition.notify_all();
+  }
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this] { return done; });
+  }
+  // true once all events happened; wait must still be called before the
+  // latch is destroyed
+  bool try_wait() const { return count.load(std::memory_order_acquire) == 0; }
+
+ private:
+  std::atomic<size_t> count;
+  bool done;
+  std::mutex mutex;
+  std::condition_variable condition;
+};
+
+class ThreadPool;
+
+// a task stored inline in a fixed-size slot, which its pool recycles once the
+// task ran; a callable too big for the slot is kept on the heap instead
+class TaskSlot {
+ public:
+  TaskSlot() : call(nullptr), generation(0), next(nullptr), home(0) {}
+
+  template <class F>
+  void emplace(F&& f) {
+    typedef typename std::decay<F>::type Fn;
+    typedef std::integral_constant<
+        bool, (sizeof(Fn) <= sizeof(storage) &&
+               alignof(Fn) <= alignof(std::max_align_t))>
+        fits;
+    emplace_as<Fn>(std::forward<F>(f), fits());
+  }
+
+  // runs the callable and destroys it; a callable that throws terminates
+  // the program, as the slot has nowhere to keep the exception
+  void run() noexcept { call(this, true); }
+  // destroys the callable without running it
+  void discard() { call(this, false); }
+
+ private:
+  friend class ThreadPool;
+  friend class TaskHandle;
+
+  template <class Fn, class F>
+  void emplace_as(F&& f, std::true_type) {
+    new (address()) Fn(std::forward<F>(f));
+    call = &call_inline<Fn>;
+  }
+  template <class Fn, class F>
+  void emplace_as(F&& f, std::false_type) {
+    new (address()) Fn*(new Fn(std::forward<F>(f)));
+    call = &call_heap<Fn>;
+  }
+  template <class Fn>
+  static void call_inline(TaskSlot* slot, bool run) {
+    Fn* fn = static_cast<Fn*>(slot->address());
+    if (run) (*fn)();
+    fn->~Fn();
+  }
+  template <class Fn>
+  static void call_heap(TaskSlot* slot, bool run) {
+    Fn* fn = *static_cast<Fn**>(slot->address());
+    if (run) (*fn)();
+    delete fn;
+  }
+  void* address() { return static_cast<void*>(&storage); }
+
+  typename std::aligned_storage<96, alignof(std::max_align_t)>::type storage;
+  void (*call)(TaskSlot*, bool);
+  // tasks the slot has completed
+  std::atomic<uint64_t> generation;
+  // the next slot in a free list or in the pool's queue
+  TaskSlot* next;
+  // the free list the slot returns to
+  size_t home;
+};
+
+// completion of a task submitted with ThreadPool::post; it may not outlive
+// the pool
+class TaskHandle {
+ public:
+  TaskHandle() : slot(nullptr), generation(0) {}
+  bool done() const {
+    return slot == nullptr ||
+           slot->generation.load(std::memory_order_acquire) != generation;
+  }
+
+ private:
+  friend class ThreadPool;
+  TaskHandle(const TaskSlot* slot, uint64_t generation)
+      : slot(slot), generation(generation) {}
+  const TaskSlot* slot;
+  uint64_t generation;
+};
+
+// Chase-Lev work-stealing deque of tasks. Its owner pushes and pops at the
+// bottom, last in first out; other threads steal from the top, first in
+// first out. The ring grows when full, and outgrown rings are kept until the
+// deque is destroyed, since a thief may still read from one.
+class WorkDeque {
+ public:
+  typedef TaskSlot Task;
+
+  WorkDeque() : top(0), bottom(0), ring(new Ring(64)) {}
+  ~WorkDeque() { delete ring.load(std::memory_order_relaxed); }
+
+  // owner only
+  void push(Task* task) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Ring* r = ring.load(std::memory_order_relaxed);
+    if (b - t > r->capacity - 1) r = grow(r, t, b);
+    r->at(b).store(task, std::memory_order_relaxed);
+    // publishes the task to thieves, which read bottom with acquire
+    bottom.store(b + 1, std::memory_order_release);
+  }
+
+  // owner only; nullptr if the deque is empty
+  Task* pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Ring* r = ring.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+    Task* task = nullptr;
+    if (t <= b) {
+      task = r->at(b).load(std::memory_order_relaxed);
+      if (t == b) {
+        // the last task, raced for with thieves
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+          task = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  // any thread; nullptr if the deque is empty or another thread won the race
+  Task* steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b) return nullptr;
+    Task* task =
+        ring.load(std::memory_order_acquire)->at(t).load(
+            std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return task;
+  }
+
+ private:
+  struct Ring {
+    explicit Ring(int64_t capacity)
+        : capacity(capacity), slots(new std::atomic<Task*>[capacity]) {}
+    std::atomic<Task*>& at(int64_t i) { return slots[i & (capacity - 1)]; }
+    int64_t capacity;
+    std::unique_ptr<std::atomic<Task*>[]> slots;
+  };
+
+  Ring* grow(Ring* old, int64_t t, int64_t b) {
+    Ring* r = new Ring(2 * old->capacity);
+    for (int64_t i = t; i < b; ++i) {
+      r->at(i).store(old->at(i).load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+    }
+    retired.emplace_back(old);
+    ring.store(r, std::memory_order_release);
+    return r;
+  }
+
+  // top and bottom sit on separate cache lines
+  std::atomic<int64_t> top;
+  char top_padding[64 - sizeof(std::atomic<int64_t>)];
+  std::atomic<int64_t> bottom;
+  char bottom_padding[64 - sizeof(std::atomic<int64_t>)];
+  std::atomic<Ring*> ring;
+  std::vector<std::unique_ptr<Ring> > retired;
+};
+
+// Vyukov's bounded multi-producer multi-consumer queue of tasks. Every cell
+// carries a sequence number that tells producers and consumers whose turn it
+// is, so push and pop each cost one compare-and-swap on their position.
+class TaskRing {
+ public:
+  // capacity is a power of two of at least 2
+  explicit TaskRing(size_t capacity)
+      : cells(new cell[capacity]),
+        mask(capacity - 1),
+        enqueue_pos(0),
+        dequeue_pos(0) {
+    for (size_t i = 0; i < capacity; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // false if the ring is full
+  bool push(TaskSlot* task) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    cell* c;
+    for (;;) {
+      c = &cells[pos & mask];
+      size_t sequence = c->sequence.load(std::memory_order_acquire);
+      intptr_t dif = static_cast<intptr_t>(sequence - pos);
+      if (dif == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    c->task = task;
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // nullptr if the ring is empty
+  TaskSlot* pop() {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    cell* c;
+    for (;;) {
+      c = &cells[pos & mask];
+      size_t sequence = c->sequence.load(std::memory_order_acquire);
+      intptr_t dif = static_cast<intptr_t>(sequence - (pos + 1));
+      if (dif == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return nullptr;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    TaskSlot* task = c->task;
+    c->sequence.store(pos + mask + 1, std::memory_order_release);
+    return task;
+  }
+
+ private:
+  struct cell {
+    std::atomic<size_t> sequence;
+    TaskSlot* task;
+  };
+
+  std::unique_ptr<cell[]> cells;
+  size_t mask;
+  // producers and consumers advance on separate cache lines
+  char cells_padding[64 - sizeof(std::unique_ptr<cell[]>) - sizeof(size_t)];
+  std::atomic<size_t> enqueue_pos;
+  char enqueue_padding[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeue_pos;
+};
+
+// how tasks from threads outside a pool reach its workers
+enum class queue_backend {
+  // a list guarded by a mutex
+  locked,
+  // a bounded lock-free ring, spilling to the locked list when full; free
+  // task slots of outside threads circulate through a second ring
+  lock_free
+};
+
+// how long a worker that found no task keeps looking before it sleeps: first
+// spins rounds with a pause between them, then yields rounds giving up its
+// time slice; a sleeping worker costs a wakeup through the kernel
+struct idle_policy {
+  size_t spins;
+  size_t yields;
+};
+
+// tells the core that the thread is spinning
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// where the workers of a pool run
+enum class pinning {
+  // wherever the scheduler puts them
+  none,
+  // each on its own cpu, filling one NUMA node before the next
+  compact,
+  // each on its own cpu, taking the NUMA nodes in turn
+  scatter
+};
+
+// the cpus this process may run on, grouped by NUMA node. Read from
+// /sys/devices/system/node without libnuma; a machine that does not
+// describe its nodes is one node.
+class CpuTopology {
+ public:
+  static CpuTopology discover();
+  // parses a kernel cpu list such as "0-3,8,10-11"
+  static std::vector<int> parse_cpu_list(const std::string& list);
+  size_t nodes() const { return cpus.size(); }
+  const std::vector<int>& node_cpus(size_t node) const { return cpus[node]; }
+  // the cpu and node of each of threads workers; a cpu of -1 leaves the
+  // worker unpinned
+  void place(size_t threads, pinning mode, std::vector<int>* cpu_of,
+             std::vector<size_t>* node_of) const;
+
+ private:
+  std::vector<std::vector<int> > cpus;
+};
+
+inline std::vector<int> CpuTopology::parse_cpu_list(const std::string& list) {
+  std::vector<int> result;
+  size_t i = 0;
+  while (i < list.size()) {
+    if (list[i] < '0' || list[i] > '9') {
+      ++i;
+      continue;
+    }
+    size_t end = 0;
+    int first = std::stoi(list.substr(i), &end), last = first;
+    i += end;
+    if (i < list.size() && list[i] == '-') {
+      last = std::stoi(list.substr(++i), &end);
+      i += end;
+    }
+    for (int cpu = first; cpu <= last; ++cpu) result.push_back(cpu);
+  }
+  return result;
+}
+
+inline CpuTopology CpuTopology::discover() {
+  CpuTopology topology;
+  std::vector<int> allowed;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) allowed.push_back(cpu);
+    }
+  }
+  const std::string root = "/sys/devices/system/node/";
+  std::string line;
+  std::ifstream online(root + "online");
+  if (!allowed.empty() && std::getline(online, line)) {
+    for (int node : parse_cpu_list(line)) {
+      std::ifstream list(root + "node" + std::to_string(node) + "/cpulist");
+      std::vector<int> cpus;
+      if (std::getline(list, line)) cpus = parse_cpu_list(line);
+      // only the cpus of this process, and only nodes that have some
+      cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                                [&set](int cpu) {
+                                  return cpu >= CPU_SETSIZE ||
+                                         !CPU_ISSET(cpu, &set);
+                                }),
+                 cpus.end());
+      if (!cpus.empty()) topology.cpus.push_back(cpus);
+    }
+  }
+#endif
+  if (topology.cpus.empty()) topology.cpus.push_back(allowed);
+  return topology;
+}
+
+inline void CpuTopology::place(size_t threads, pinning mode,
+                               std::vector<int>* cpu_of,
+                               std::vector<size_t>* node_of) const {
+  cpu_of->assign(threads, -1);
+  node_of->assign(threads, 0);
+  if (mode == pinning::none) return;
+  // cpus in the order workers take them; more workers than cpus wrap around
+  std::vector<std::pair<int, size_t> > order;
+  for (size_t k = 0; mode == pinning::scatter; ++k) {
+    bool any = false;
+    for (size_t node = 0; node < cpus.size(); ++node) {
+      if (k >= cpus[node].size()) continue;
+      order.emplace_back(cpus[node][k], node);
+      any = true;
+    }
+    if (!any) break;
+  }
+  for (size_t node = 0; mode == pinning::compact && node < cpus.size();
+       ++node) {
+    for (int cpu : cpus[node]) order.emplace_back(cpu, node);
+  }
+  if (order.empty()) return;
+  for (size_t i = 0; i < threads; ++i) {
+    (*cpu_of)[i] = order[i % order.size()].first;
+    (*node_of)[i] = order[i % order.size()].second;
+  }
+}
+
+// Work-stealing pool. A task enqueued by a worker goes to the worker's own
+// deque, any other task to a shared queue. An idle worker pops its own deque,
+// then steals from the others starting at a random victim, then takes from
+// the shared queue, and sleeps only when no task is queued anywhere.
+// Tasks live in slots from per-worker free lists, refilled by slabs, so in
+// steady state queueing a task allocates nothing beyond what enqueue's
+// future needs. Pinned workers steal from the workers of their own NUMA
+// node before crossing to another.
 class ThreadPool {
  public:
-  ThreadPool(size_t);
+  // an enumerator rather than a static member, so that passing it by
+  // reference needs no definition outside the class
+  enum : size_t { default_ring_capacity = 1024 };
+  // ring_capacity, a power of two of at least 2, sizes the rings of the
+  // lock-free backend, and std::invalid_argument is thrown for any other
+  // value; placement pins
+  // the workers to the cpus of CpuTopology::discover
+  explicit ThreadPool(size_t threads,
+                      queue_backend backend = queue_backend::locked,
+                      size_t ring_capacity = default_ring_capacity,
+                      pinning placement = pinning::none);
   template <class F, class... Args>
   auto enqueue(F&& f, Args&&... args)
       -> std::future<typename std::result_of<F(Args...)>::type>;
+  // like enqueue, but lvalue arguments of class type are passed by reference
+  // instead of being copied into the task; they must outlive the task
+  template <class F, class... Args>
+  auto enqueue_ref(F&& f, Args&&... args)
+      -> std::future<typename std::result_of<F(Args...)>::type>;
+  // waits for the future of a task of this pool. On a worker of the pool it
+  // runs other queued tasks until the future is ready, so tasks waiting on
+  // their children keep the worker busy instead of idling it or
+  // deadlocking the pool; any other thread just blocks.
+  template <class T>
+  void wait(const std::future<T>& future);
+  // like enqueue, for a task whose result is not needed: the task is stored
+  // inline in a recycled slot and only a handle is returned, so in steady
+  // state nothing is allocated. The slot is recycled as soon as the task
+  // ran, so there is nowhere to keep an exception: the task must not throw,
+  // or the program terminates. TaskGroup collects exceptions instead.
+  template <class F, class... Args>
+  TaskHandle post(F&& f, Args&&... args);
+  // like post, passing arguments as enqueue_ref does
+  template <class F, class... Args>
+  TaskHandle post_ref(F&& f, Args&&... args);
+  // waits for a posted task, helping on a worker of the pool and blocking on
+  // any other thread, as the future overload does
+  void wait(const TaskHandle& handle);
+  // runs body(f, r) on chunks [f, r) of grain indices covering [begin, end),
+  // on the workers and the calling thread, and returns when all are done.
+  // grain 0 picks about eight chunks per thread. Threads claim chunks from
+  // one shared cursor and one latch counts them out; the helping workers
+  // run in recycled task slots, so nothing is allocated per chunk. body must
+  // not throw.
+  template <class Body>
+  void parallel_for(size_t begin, size_t end, size_t grain, const Body& body);
+  // like parallel_for, folding body(f, r) of every chunk into identity with
+  // combine, which must be associative and commutative
+  template <class T, class Body, class Combine>
+  T parallel_reduce(size_t begin, size_t end, size_t grain, T identity,
+                    const Body& body, const Combine& combine);
+  // like post, but the task runs on the given worker only, after the task
+  // that worker is running. A worker blocked other than in one of the
+  // pool's waits holds up its tasks.
+  template <class F, class... Args>
+  TaskHandle post_to(size_t worker, F&& f, Args&&... args);
+  // runs body(f, r) on one block [f, r) per active worker, of equal size
+  // rounded up to a multiple of grain, and returns when all are done. Block
+  // i always runs on worker i, so with pinned workers memory first touched
+  // in one call is local to the worker that uses it in the next. body must
+  // not throw.
+  template <class Body>
+  void parallel_for_static(size_t begin, size_t end, size_t grain,
+                           const Body& body);
+  size_t size() const { return workers.size(); }
+  // workers that take queued tasks, at first all of them
+  size_t active_workers() const { return active; }
+  // grows or shrinks the workers taking queued tasks to threads, at least
+  // one and at most size(). The others park once their task is done, only
+  // waking for tasks posted to them, and the tasks left in their deques are
+  // stolen by the active workers.
+  void set_active_workers(size_t threads);
+  // the NUMA node the given worker is pinned to, 0 if it is not pinned
+  size_t node_of(size_t worker) const { return worker_nodes[worker]; }
+  // replaces the idle policy, by default no spinning at all
+  void set_idle_policy(idle_policy policy) {
+    idle_spins = policy.spins;
+    idle_yields = policy.yields;
+  }
+  // while a hot section is open, idle workers never sleep: they spin as the
+  // idle policy says and then keep yielding, so back-to-back phases of an
+  // algorithm find them awake. Sleeping workers are woken when it opens.
+  class hot_section {
+   public:
+    explicit hot_section(ThreadPool& pool) : pool(pool) {
+      {
+        std::unique_lock<std::mutex> lock(pool.sleep_mutex);
+        pool.hot++;
+      }
+      pool.condition.notify_all();
+    }
+    ~hot_section() { pool.hot--; }
+
+   private:
+    ThreadPool& pool;
+  };
   ~ThreadPool();
 
  private:
+  friend class TaskGroup;
+  typedef WorkDeque::Task Task;
+
+  // how enqueue_ref stores an argument of type T
+  template <class T, class U = typename std::remove_reference<T>::type,
+            bool = std::is_lvalue_reference<T>::value &&
+                   std::is_class<U>::value>
+  struct ref_arg {
+    typedef typename std::decay<T>::type type;
+    static type wrap(T&& arg) { return std::forward<T>(arg); }
+  };
+  template <class T, class U>
+  struct ref_arg<T, U, true> {
+    typedef std::reference_wrapper<U> type;
+    static type wrap(T& arg) { return std::ref(arg); }
+  };
+
+  // the pool and index of the worker running on this thread, if any, and
+  // its state for picking victims
+  struct worker_id {
+    const ThreadPool* pool;
+    size_t index;
+    uint64_t seed;
+  };
+  static worker_id& current_worker() {
+    static thread_local worker_id id = {nullptr, 0, 0};
+    return id;
+  }
+
+  // free slots of one worker, or of all threads outside the pool. The two
+  // lists are a cache line apart, so releases by other threads do not slow
+  // down the owner; padding rather than alignas, which C++11 new ignores.
+  struct slot_cache {
+    slot_cache() : free(nullptr), returned(nullptr) {}
+    // taken and refilled by the owner only
+    TaskSlot* free;
+    char free_padding[64 - sizeof(TaskSlot*)];
+    // slots released by other threads, taken by the owner all at once
+    std::atomic<TaskSlot*> returned;
+    char returned_padding[64 - sizeof(std::atomic<TaskSlot*>)];
+  };
+  static const size_t slab_size = 64;
+
+  TaskSlot* acquire();
+  void release(TaskSlot* slot);
+  template <class F>
+  void spawn(F&& f) {
+    TaskSlot* slot = acquire();
+    slot->emplace(std::forward<F>(f));
+    submit(slot);
+  }
+  void submit(Task* task);
+  void submit_to(size_t worker, Task* task);
+  Task* find_task(size_t index, uint64_t& seed);
+  // a task posted to the given worker, for find_task
+  Task* take_mail(size_t index);
+  // a task of the deques or the shared queue, for find_task
+  Task* find_queued(size_t index, uint64_t& seed);
+  void run(Task* task);
+  void work(size_t index);
+  // on a worker of the pool, runs queued tasks until ready() holds, calling
+  // idle() whenever none is found; any other thread only calls idle()
+  template <class Ready, class Idle>
+  void help_until(const Ready& ready, const Idle& idle);
+  // threads sharing the given number of chunks, the caller included
+  size_t participants(size_t chunks) const {
+    return std::min<size_t>(chunks, active + 1);
+  }
+  // runs participant(0) to participant(n - 2) as tasks and
+  // participant(n - 1) on the caller, then waits for all of them
+  template <class Participant>
+  void share(size_t n, const Participant& participant);
+  // waits for latch, helping on a worker of the pool
+  void join(Latch& latch);
+
   // need to keep track of threads so we can join them
   std::vector<std::thread> workers;
-  // the task queue
-  std::queue<std::function<void()> > tasks;
-
-  // synchronization
+  // one deque per worker
+  std::vector<std::unique_ptr<WorkDeque> > deques;
+  // tasks enqueued from outside the pool, and free slots of threads outside
+  // the pool, with the lock-free backend
+  std::unique_ptr<TaskRing> ring;
+  std::unique_ptr<TaskRing> outside_slots;
+  // tasks enqueued from outside the pool, linked through their slots
+  Task* queue_head;
+  Task* queue_tail;
+  std::atomic<size_t> queued;
   std::mutex queue_mutex;
+
+  // tasks posted to one worker, linked through their slots; they are not
+  // counted in pending, so they wake and keep awake their worker only
+  struct mailbox {
+    mailbox() : head(nullptr), tail(nullptr), count(0) {}
+    std::mutex mutex;
+    Task* head;
+    Task* tail;
+    std::atomic<size_t> count;
+  };
+  std::vector<std::unique_ptr<mailbox> > mailboxes;
+  // cpu of every worker, -1 if it is not pinned, and its NUMA node
+  std::vector<int> worker_cpus;
+  std::vector<size_t> worker_nodes;
+
+  // one cache per worker and a last one for threads outside the pool
+  std::vector<std::unique_ptr<slot_cache> > caches;
+  std::vector<std::unique_ptr<TaskSlot[]> > slabs;
+  // guards slabs and the cache of threads outside the pool
+  std::mutex slot_mutex;
+
+  // tasks waiting in deques or in the queue; a worker sleeps only when there
+  // are none, and enqueue takes the sleep mutex only when a worker sleeps
+  std::atomic<int64_t> pending;
+  std::atomic<size_t> sleepers;
+  std::mutex sleep_mutex;
   std::condition_variable condition;
-  bool stop;
+  // workers from active on are parked on their own condition, so that the
+  // wakeups of new tasks go to active workers
+  std::atomic<size_t> active;
+  std::atomic<size_t> parkers;
+  std::condition_variable parked;
+  std::atomic<bool> stop;
+  // threads outside the pool sleeping in wait for a posted task, woken
+  // whenever a task completes while there are any
+  std::atomic<size_t> handle_waiters;
+  std::mutex handle_mutex;
+  std::condition_variable handle_condition;
+  std::atomic<size_t> idle_spins;
+  std::atomic<size_t> idle_yields;
+  // open hot sections
+  std::atomic<size_t> hot;
 };
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(size_t threads) : stop(false) {
+inline ThreadPool::ThreadPool(size_t threads, queue_backend backend,
+                              size_t ring_capacity, pinning placement)
+    : queue_head(nullptr),
+      queue_tail(nullptr),
+      queued(0),
+      pending(0),
+      sleepers(0),
+      active(threads),
+      parkers(0),
+      stop(false),
+      handle_waiters(0),
+      idle_spins(0),
+      idle_yields(0),
+      hot(0) {
+  // a ring indexes its cells by masking, which needs a power of two, and
+  // its sequence numbers only tell a full cell from an empty one with two
+  if (ring_capacity < 2 || (ring_capacity & (ring_capacity - 1)) != 0)
+    throw std::invalid_argument("ring capacity is not a power of two");
+  for (size_t i = 0; i < threads; ++i) deques.emplace_back(new WorkDeque());
+  for (size_t i = 0; i <= threads; ++i) caches.emplace_back(new slot_cache());
+  for (size_t i = 0; i < threads; ++i) mailboxes.emplace_back(new mailbox());
+  if (placement == pinning::none) {
+    worker_cpus.assign(threads, -1);
+    worker_nodes.assign(threads, 0);
+  } else {
+    CpuTopology::discover().place(threads, placement, &worker_cpus,
+                                  &worker_nodes);
+  }
+  if (backend == queue_backend::lock_free) {
+    ring.reset(new TaskRing(ring_capacity));
+    outside_slots.reset(new TaskRing(ring_capacity));
+  }
   for (size_t i = 0; i < threads; ++i)
-    workers.emplace_back([this] {
-      for (;;) {
-        std::function<void()> task;
-
-        {
-          std::unique_lock<std::mutex> lock(this->queue_mutex);
-          this->condition.wait(
-              lock, [this] { return this->stop || !this->tasks.empty(); });
-          if (this->stop && this->tasks.empty()) return;
-          task = std::move(this->tasks.front());
-          this->tasks.pop();
-        }
+    workers.emplace_back([this, i] { this->work(i); });
+}
 
-        task();
+inline TaskSlot* ThreadPool::acquire() {
+  worker_id& me = current_worker();
+  const bool inside = me.pool == this;
+  const size_t home = inside ? me.index : workers.size();
+  if (!inside && outside_slots) {
+    TaskSlot* slot = outside_slots->pop();
+    if (slot != nullptr) return slot;
+  }
+  slot_cache& cache = *caches[home];
+  std::unique_lock<std::mutex> lock(slot_mutex, std::defer_lock);
+  if (!inside) lock.lock();
+  if (cache.free == nullptr) {
+    cache.free = cache.returned.exchange(nullptr, std::memory_order_acquire);
+  }
+  if (cache.free == nullptr) {
+    if (inside) lock.lock();
+    TaskSlot* slab = new TaskSlot[slab_size];
+    slabs.emplace_back(slab);
+    for (size_t i = 0; i < slab_size; ++i) {
+      slab[i].home = home;
+      slab[i].next = i + 1 < slab_size ? &slab[i + 1] : nullptr;
+    }
+    cache.free = slab;
+  }
+  TaskSlot* slot = cache.free;
+  cache.free = slot->next;
+  return slot;
+}
+
+inline void ThreadPool::release(TaskSlot* slot) {
+  // completes the handle before the slot can be reused; pairs with the
+  // increment of handle_waiters in wait, as pending does with sleepers
+  slot->generation.fetch_add(1);
+  if (handle_waiters > 0) {
+    { std::unique_lock<std::mutex> lock(handle_mutex); }
+    handle_condition.notify_all();
+  }
+  if (slot->home == workers.size() && outside_slots &&
+      outside_slots->push(slot)) {
+    return;
+  }
+  worker_id& me = current_worker();
+  slot_cache& cache = *caches[slot->home];
+  if (me.pool == this && me.index == slot->home) {
+    slot->next = cache.free;
+    cache.free = slot;
+    return;
+  }
+  TaskSlot* head = cache.returned.load(std::memory_order_relaxed);
+  do {
+    slot->next = head;
+  } while (!cache.returned.compare_exchange_weak(
+      head, slot, std::memory_order_release, std::memory_order_relaxed));
+}
+
+inline void ThreadPool::submit(Task* task) {
+  // don't allow enqueueing after stopping the pool
+  if (stop) {
+    task->discard();
+    release(task);
+    throw std::runtime_error("enqueue on stopped ThreadPool");
+  }
+  worker_id& me = current_worker();
+  if (me.pool == this) {
+    deques[me.index]->push(task);
+  } else if (!ring || !ring->push(task)) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    task->next = nullptr;
+    (queue_tail != nullptr ? queue_tail->next : queue_head) = task;
+    queue_tail = task;
+    queued++;
+  }
+  // pairs with the increment of sleepers in work: either the sleeper sees
+  // the task, or this sees the sleeper
+  pending++;
+  if (sleepers > 0) {
+    { std::unique_lock<std::mutex> lock(sleep_mutex); }
+    condition.notify_one();
+  }
+}
+
+inline void ThreadPool::set_active_workers(size_t threads) {
+  if (workers.empty()) return;
+  threads = std::max<size_t>(1, std::min(threads, workers.size()));
+  {
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    active = threads;
+  }
+  condition.notify_all();
+  parked.notify_all();
+}
+
+inline void ThreadPool::submit_to(size_t worker, Task* task) {
+  if (stop) {
+    task->discard();
+    release(task);
+    throw std::runtime_error("enqueue on stopped ThreadPool");
+  }
+  mailbox& mail = *mailboxes[worker];
+  {
+    std::unique_lock<std::mutex> lock(mail.mutex);
+    task->next = nullptr;
+    (mail.tail != nullptr ? mail.tail->next : mail.head) = task;
+    mail.tail = task;
+    mail.count++;
+  }
+  // as in submit; the worker may be any of the sleepers, or parked
+  if (sleepers > 0 || parkers > 0) {
+    { std::unique_lock<std::mutex> lock(sleep_mutex); }
+    condition.notify_all();
+    parked.notify_all();
+  }
+}
+
+inline ThreadPool::Task* ThreadPool::take_mail(size_t index) {
+  mailbox& mail = *mailboxes[index];
+  if (mail.count == 0) return nullptr;
+  std::unique_lock<std::mutex> lock(mail.mutex);
+  Task* task = mail.head;
+  mail.head = task->next;
+  if (mail.head == nullptr) mail.tail = nullptr;
+  mail.count--;
+  return task;
+}
+
+inline ThreadPool::Task* ThreadPool::find_task(size_t index, uint64_t& seed) {
+  Task* task = take_mail(index);
+  if (task != nullptr) return task;
+  task = find_queued(index, seed);
+  if (task != nullptr) pending--;
+  return task;
+}
+
+inline ThreadPool::Task* ThreadPool::find_queued(size_t index,
+                                                 uint64_t& seed) {
+  Task* task = deques[index]->pop();
+  if (task != nullptr) return task;
+  const size_t n = deques.size();
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  // victims of the own node first, then all the others
+  for (size_t pass = 0; pass < 2; ++pass) {
+    for (size_t k = 0, victim = seed % n; k < n;
+         ++k, victim = (victim + 1) % n) {
+      if (victim == index ||
+          (worker_nodes[victim] == worker_nodes[index]) != (pass == 0)) {
+        continue;
       }
+      task = deques[victim]->steal();
+      if (task != nullptr) return task;
+    }
+  }
+  if (ring) {
+    task = ring->pop();
+    if (task != nullptr) return task;
+  }
+  if (queued > 0) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    if (queue_head != nullptr) {
+      task = queue_head;
+      queue_head = task->next;
+      if (queue_head == nullptr) queue_tail = nullptr;
+      queued--;
+    }
+  }
+  return task;
+}
+
+inline void ThreadPool::run(Task* task) {
+  task->run();
+  release(task);
+}
+
+inline void ThreadPool::work(size_t index) {
+  worker_id& me = current_worker();
+  me = worker_id{this, index, index + 1};
+#ifdef __linux__
+  if (worker_cpus[index] >= 0) {
+    // best effort; an unpinned worker still works
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker_cpus[index], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+  }
+#endif
+  mailbox& mail = *mailboxes[index];
+  size_t idle = 0;
+  for (;;) {
+    if (index >= active) {
+      // a parked worker runs only the tasks posted to it
+      Task* task = take_mail(index);
+      if (task != nullptr) {
+        run(task);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      // a stopping pool still runs what was posted to it
+      if (stop) {
+        if (mail.count == 0) return;
+        continue;
+      }
+      // passes on a wakeup it may have taken from an active worker
+      if (pending > 0) condition.notify_one();
+      parkers++;
+      parked.wait(lock, [this, index, &mail] {
+        return this->stop || index < this->active || mail.count > 0;
+      });
+      parkers--;
+      continue;
+    }
+    Task* task = find_task(index, me.seed);
+    if (task != nullptr) {
+      run(task);
+      idle = 0;
+      continue;
+    }
+    if (!stop && (hot > 0 || idle < idle_spins + idle_yields)) {
+      if (idle < idle_spins) {
+        cpu_relax();
+      } else {
+        std::this_thread::yield();
+      }
+      idle++;
+      continue;
+    }
+    idle = 0;
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    sleepers++;
+    condition.wait(lock, [this, index, &mail] {
+      return this->stop || this->pending > 0 || this->hot > 0 ||
+             mail.count > 0 || index >= this->active;
     });
+    sleepers--;
+    if (stop && pending <= 0 && mail.count == 0) return;
+  }
 }
 
 // add new work item to the pool
@@ -62,26 +962,331 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
       std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
   std::future<return_type> res = task->get_future();
-  {
-    std::unique_lock<std::mutex> lock(queue_mutex);
+  spawn([task]() { (*task)(); });
+  return res;
+}
+
+template <class F, class... Args>
+auto ThreadPool::enqueue_ref(F&& f, Args&&... args)
+    -> std::future<typename std::result_of<F(Args...)>::type> {
+  return enqueue(std::forward<F>(f),
+                 ref_arg<Args>::wrap(std::forward<Args>(args))...);
+}
 
-    // don't allow enqueueing after stopping the pool
-    if (stop) throw std::runtime_error("enqueue on stopped ThreadPool");
+template <class F, class... Args>
+TaskHandle ThreadPool::post(F&& f, Args&&... args) {
+  TaskSlot* slot = acquire();
+  slot->emplace(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+  TaskHandle handle(slot, slot->generation.load(std::memory_order_relaxed));
+  submit(slot);
+  return handle;
+}
 
-    tasks.emplace([task]() { (*task)(); });
+template <class F, class... Args>
+TaskHandle ThreadPool::post_ref(F&& f, Args&&... args) {
+  return post(std::forward<F>(f),
+              ref_arg<Args>::wrap(std::forward<Args>(args))...);
+}
+
+template <class F, class... Args>
+TaskHandle ThreadPool::post_to(size_t worker, F&& f, Args&&... args) {
+  TaskSlot* slot = acquire();
+  slot->emplace(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+  TaskHandle handle(slot, slot->generation.load(std::memory_order_relaxed));
+  submit_to(worker, slot);
+  return handle;
+}
+
+inline void ThreadPool::wait(const TaskHandle& handle) {
+  if (current_worker().pool == this) {
+    help_until([&handle] { return handle.done(); },
+               [] { std::this_thread::yield(); });
+    return;
   }
-  condition.notify_one();
-  return res;
+  // any other thread sleeps until a task completes
+  if (handle.done()) return;
+  std::unique_lock<std::mutex> lock(handle_mutex);
+  handle_waiters++;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  handle_condition.wait(lock, [&handle] { return handle.done(); });
+  handle_waiters--;
+}
+
+template <class Ready, class Idle>
+void ThreadPool::help_until(const Ready& ready, const Idle& idle) {
+  worker_id& me = current_worker();
+  while (!ready()) {
+    Task* task = me.pool == this ? find_task(me.index, me.seed) : nullptr;
+    if (task != nullptr) {
+      run(task);
+    } else {
+      idle();
+    }
+  }
+}
+
+template <class T>
+void ThreadPool::wait(const std::future<T>& future) {
+  if (current_worker().pool != this) {
+    future.wait();
+    return;
+  }
+  help_until(
+      [&future] {
+        return future.wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready;
+      },
+      // the awaited task runs elsewhere; look for work again shortly
+      [&future] { future.wait_for(std::chrono::microseconds(50)); });
 }
 
-// the destructor joins all threads
+template <class Participant>
+void ThreadPool::share(size_t n, const Participant& participant) {
+  Latch latch(n - 1);
+  size_t spawned = 0;
+  try {
+    for (; spawned + 1 < n; ++spawned) {
+      const size_t i = spawned;
+      spawn([&participant, &latch, i] {
+        participant(i);
+        latch.count_down();
+      });
+    }
+  } catch (...) {
+    // the participants already queued refer to latch and participant
+    for (size_t i = spawned; i + 1 < n; ++i) latch.count_down();
+    join(latch);
+    throw;
+  }
+  participant(n - 1);
+  join(latch);
+}
+
+inline void ThreadPool::join(Latch& latch) {
+  if (current_worker().pool == this) {
+    help_until([&latch] { return latch.try_wait(); },
+               [] { std::this_thread::yield(); });
+  }
+  latch.wait();
+}
+
+template <class Body>
+void ThreadPool::parallel_for(size_t begin, size_t end, size_t grain,
+                              const Body& body) {
+  if (begin >= end) return;
+  const size_t n = end - begin;
+  if (grain == 0) grain = std::max<size_t>(1, n / (8 * participants(n)));
+  std::atomic<size_t> next(begin);
+  share(participants((n + grain - 1) / grain), [&](size_t) {
+    for (size_t f = next.fetch_add(grain); f < end; f = next.fetch_add(grain))
+      body(f, std::min(end, f + grain));
+  });
+}
+
+template <class T, class Body, class Combine>
+T ThreadPool::parallel_reduce(size_t begin, size_t end, size_t grain,
+                              T identity, const Body& body,
+                              const Combine& combine) {
+  if (begin >= end) return identity;
+  const size_t n = end - begin;
+  if (grain == 0) grain = std::max<size_t>(1, n / (8 * participants(n)));
+  const size_t threads = participants((n + grain - 1) / grain);
+  std::vector<T> partials(threads, identity);
+  std::atomic<size_t> next(begin);
+  share(threads, [&](size_t i) {
+    T partial = identity;
+    for (size_t f = next.fetch_add(grain); f < end; f = next.fetch_add(grain))
+      partial = combine(partial, body(f, std::min(end, f + grain)));
+    partials[i] = partial;
+  });
+  T result = identity;
+  for (const T& partial : partials) result = combine(result, partial);
+  return result;
+}
+
+template <class Body>
+void ThreadPool::parallel_for_static(size_t begin, size_t end, size_t grain,
+                                     const Body& body) {
+  if (begin >= end) return;
+  if (workers.empty()) {
+    body(begin, end);
+    return;
+  }
+  const size_t n = end - begin, threads = active;
+  size_t block = (n + threads - 1) / threads;
+  if (grain > 0) block = (block + grain - 1) / grain * grain;
+  const size_t blocks = (n + block - 1) / block;
+  Latch latch(blocks);
+  size_t submitted = 0;
+  try {
+    for (size_t f = begin; f < end; ++submitted, f += block) {
+      const size_t r = std::min(end, f + block);
+      TaskSlot* slot = acquire();
+      slot->emplace([&body, &latch, f, r] {
+        body(f, r);
+        latch.count_down();
+      });
+      submit_to(submitted, slot);
+    }
+  } catch (...) {
+    // as in share, the blocks already posted refer to latch and body
+    for (size_t i = submitted; i < blocks; ++i) latch.count_down();
+    join(latch);
+    throw;
+  }
+  join(latch);
+}
+
+// the destructor joins all threads once every queued task has run
 inline ThreadPool::~ThreadPool() {
   {
-    std::unique_lock<std::mutex> lock(queue_mutex);
+    std::unique_lock<std::mutex> lock(sleep_mutex);
     stop = true;
   }
   condition.notify_all();
+  parked.notify_all();
   for (std::thread& worker : workers) worker.join();
+  // a task posted to a worker just as it returned, by a post_to that saw
+  // the pool still running; any task it posts in turn is rejected
+  for (size_t i = 0; i < mailboxes.size(); ++i) {
+    for (Task* task = take_mail(i); task != nullptr; task = take_mail(i))
+      run(task);
+  }
+}
+
+class TaskGroup;
+
+// what a task of a group checks to stop early once the group is cancelled
+class CancellationToken {
+ public:
+  CancellationToken() : group(nullptr) {}
+  bool cancelled() const;
+
+ private:
+  friend class TaskGroup;
+  explicit CancellationToken(const TaskGroup* group) : group(group) {}
+  const TaskGroup* group;
+};
+
+// tasks spawned on a pool and waited for together. Cancelling a group, or a
+// group it is nested in, drops the tasks it has not started and any it would
+// spawn later; running tasks only learn of it through cancelled(), which
+// long loops should check. The first exception a task throws cancels the
+// group and is rethrown by wait. Tasks may spawn into their group; otherwise
+// spawn and wait belong to the thread owning the group.
+class TaskGroup {
+ public:
+  explicit TaskGroup(ThreadPool& pool) : TaskGroup(pool, nullptr) {}
+  // a group also cancelled with parent, which must outlive it
+  TaskGroup(ThreadPool& pool, const TaskGroup& parent)
+      : TaskGroup(pool, &parent) {}
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+  // cancels the tasks not waited for and waits for them, dropping their
+  // exception
+  ~TaskGroup();
+  template <class F>
+  void spawn(F&& f);
+  // waits for every task spawned so far, helping on a worker of the pool,
+  // then rethrows the first exception of a task, if any
+  void wait();
+  void cancel() { cancel_flag = true; }
+  bool cancelled() const {
+    return cancel_flag.load(std::memory_order_relaxed) ||
+           (parent != nullptr && parent->cancelled());
+  }
+  CancellationToken token() const { return CancellationToken(this); }
+
+ private:
+  TaskGroup(ThreadPool& pool, const TaskGroup* parent)
+      : pool(pool),
+        parent(parent),
+        cancel_flag(false),
+        unfinished(0),
+        rounds(0),
+        signals(0) {}
+  template <class Fn>
+  void run_task(Fn& fn);
+  void finish();
+
+  ThreadPool& pool;
+  const TaskGroup* parent;
+  std::atomic<bool> cancel_flag;
+  std::atomic<size_t> unfinished;
+  // times unfinished left 0, and times the last task of such a round
+  // signalled reaching it again. As in Latch, only that task takes the lock,
+  // so once the two are equal the group may be destroyed.
+  size_t rounds;
+  size_t signals;
+  // the first exception of a task
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable condition;
+};
+
+inline bool CancellationToken::cancelled() const {
+  return group != nullptr && group->cancelled();
+}
+
+template <class F>
+void TaskGroup::spawn(F&& f) {
+  // a cancelled group never schedules its task
+  if (cancelled()) return;
+  if (unfinished.fetch_add(1, std::memory_order_relaxed) == 0) {
+    std::unique_lock<std::mutex> lock(mutex);
+    rounds++;
+  }
+  try {
+    pool.post(&TaskGroup::run_task<typename std::decay<F>::type>, this,
+              std::forward<F>(f));
+  } catch (...) {
+    finish();
+    throw;
+  }
+}
+
+template <class Fn>
+void TaskGroup::run_task(Fn& fn) {
+  if (!cancelled()) {
+    try {
+      fn();
+    } catch (...) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (error == nullptr) error = std::current_exception();
+      cancel_flag = true;
+    }
+  }
+  finish();
+}
+
+inline void TaskGroup::finish() {
+  if (unfinished.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+  std::unique_lock<std::mutex> lock(mutex);
+  signals++;
+  condition.notify_all();
+}
+
+inline void TaskGroup::wait() {
+  if (ThreadPool::current_worker().pool == &pool) {
+    pool.help_until(
+        [this] { return unfinished.load(std::memory_order_acquire) == 0; },
+        [] { std::this_thread::yield(); });
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [this] { return signals == rounds; });
+  if (error != nullptr) {
+    std::exception_ptr first = error;
+    error = nullptr;
+    std::rethrow_exception(first);
+  }
+}
+
+inline TaskGroup::~TaskGroup() {
+  if (unfinished > 0) cancel();
+  try {
+    wait();
+  } catch (...) {
+  }
 }
 
 #endif